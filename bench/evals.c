@@ -0,0 +1,59 @@
+/*
+ * In-process throughput of libtlisp: evaluations per second of small
+ * expressions on one interpreter, and interpreters created, used once
+ * and deleted per second.
+ */
+#define _POSIX_C_SOURCE 199309L
+#include "../tlisp.h"
+#include <stdio.h>
+#include <time.h>
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* (add2 x) from C */
+static tlisp_value_t* add2(tlisp_state_t* s, tlisp_value_t* args, void* data)
+{
+	long x = tlisp_num(tlisp_cell(args, 0));
+	tlisp_free(s, args);
+	return tlisp_make_num(s, x + 2);
+}
+
+static void run(tlisp_state_t* s, const char* name, const char* src, long n)
+{
+	double start = now();
+	for (long i = 0; i < n; i++) {
+		tlisp_free(s, tlisp_eval(s, src));
+	}
+	double t = now() - start;
+	printf("%-28s %10.0f evals/s\n", name, n / t);
+}
+
+int main(void)
+{
+	tlisp_state_t* s = tlisp_state_new();
+	tlisp_register(s, "add2", add2, NULL);
+	tlisp_free(s, tlisp_eval(s, "def {sq} (\\ {x} {* x x})"));
+	tlisp_free(s, tlisp_eval(s, "def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})"));
+
+	run(s, "arithmetic (+ 1 2)", "+ 1 2", 1000000);
+	run(s, "lambda call (sq 12)", "sq 12", 1000000);
+	run(s, "native builtin (add2 40)", "add2 40", 1000000);
+	run(s, "list (map sq {1 2 3 4})", "map sq {1 2 3 4}", 300000);
+	run(s, "recursion (fib 15)", "fib 15", 3000);
+	tlisp_state_del(s);
+
+	long n = 2000;
+	double start = now();
+	for (long i = 0; i < n; i++) {
+		tlisp_state_t* t = tlisp_state_new();
+		tlisp_free(t, tlisp_eval(t, "+ 1 2"));
+		tlisp_state_del(t);
+	}
+	printf("%-28s %10.0f per s\n", "new + eval + del", n / (now() - start));
+	return 0;
+}
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Time each benchmark script by piping it through the REPL.
+#   map.tl       native map over 1,000,000 elements
+#   map-lisp.tl  recursive Lisp-level map over 2,000 elements
+#   fib.tl       doubly recursive (fib 35), runs on the VM
+#   loop.tl      40,000,000 tail calls, runs on the VM
+#   pmap.tl      64 calls of (fib 30) through pmap, see scale.sh for threads
+#   preduce.tl   sum of 2,000,000 numbers through preduce
+#   par.tl       8 calls of (fib 32) as the arguments of one par call
+#   spawn.tl     8 futures of (fib 32) spawned and awaited
+#   green.tl     500 values through a pipeline of 200 green threads and channels
+#   chan.tl      500,000 values from 2 green producers to 2 consumers over a channel
+#   actor.tl     200,000 messages to 8 actors, each summing its own
+#   evals.c      in-process evaluations per second through libtlisp
+# Extra interpreter flags (e.g. --no-jit, --vm-switch, --no-vm) go in BENCH_FLAGS.
+cd "$(dirname "$0")/.." || exit 1
+for f in bench/*.tl; do
+	start=$(date +%s%N)
+	./main $BENCH_FLAGS < "$f" > /dev/null
+	end=$(date +%s%N)
+	awk -v f="$f" -v ns=$((end - start)) 'BEGIN { printf "%-20s %8.3f s\n", f, ns / 1e9 }'
+done
+[ -x bench/evals ] && ./bench/evals
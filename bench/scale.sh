@@ -0,0 +1,29 @@
+#!/bin/sh
+# Time the parallel builtins with 1, 2, 4, ... worker threads up to the
+# number of processors (or $CPUS), and the speedup over 1 thread.
+#   pmap.tl      64 calls of (fib 30) through pmap
+#   preduce.tl   sum of 2,000,000 numbers with a Lisp-level + through preduce
+#   par.tl       8 calls of (fib 32) evaluated at once as arguments of +
+#   spawn.tl     8 futures of (fib 32), spawned at once and then awaited
+#   green.tl     500 values through a pipeline of 200 green threads
+#   chan.tl      500,000 values through one channel, 2 producers and 2 consumers
+#   actor.tl     200,000 messages to 8 actors from 8 green threads
+cd "$(dirname "$0")/.." || exit 1
+cpus=${CPUS:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)}
+for f in bench/pmap.tl bench/preduce.tl bench/par.tl bench/spawn.tl bench/green.tl \
+		bench/chan.tl bench/actor.tl; do
+	base=
+	n=1
+	while :; do
+		start=$(date +%s%N)
+		./main --threads $n < "$f" > /dev/null
+		end=$(date +%s%N)
+		ns=$((end - start))
+		[ -z "$base" ] && base=$ns
+		awk -v f="$f" -v n=$n -v ns=$ns -v base=$base \
+			'BEGIN { printf "%-20s threads %-4d %8.3f s  %5.2fx\n", f, n, ns / 1e9, base / ns }'
+		[ $n -ge "$cpus" ] && break
+		n=$((n * 2))
+		[ $n -gt "$cpus" ] && n=$cpus
+	done
+done
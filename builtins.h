@@ -0,0 +1,127 @@
+/* Generated from builtins.def by gen-builtins.awk, do not edit */
+lval* builtin_list(lenv* e, lval* a);
+lval* builtin_head(lenv* e, lval* a);
+lval* builtin_tail(lenv* e, lval* a);
+lval* builtin_eval(lenv* e, lval* a);
+lval* builtin_join(lenv* e, lval* a);
+lval* builtin_len(lenv* e, lval* a);
+lval* builtin_nth(lenv* e, lval* a);
+lval* builtin_reverse(lenv* e, lval* a);
+lval* builtin_range(lenv* e, lval* a);
+lval* builtin_map(lenv* e, lval* a);
+lval* builtin_filter(lenv* e, lval* a);
+lval* builtin_foldl(lenv* e, lval* a);
+lval* builtin_foldr(lenv* e, lval* a);
+lval* builtin_lazy_range(lenv* e, lval* a);
+lval* builtin_iterate(lenv* e, lval* a);
+lval* builtin_take(lenv* e, lval* a);
+lval* builtin_collect(lenv* e, lval* a);
+lval* builtin_add(lenv* e, lval* a);
+lval* builtin_sub(lenv* e, lval* a);
+lval* builtin_mul(lenv* e, lval* a);
+lval* builtin_div(lenv* e, lval* a);
+lval* builtin_lambda(lenv* e, lval* a);
+lval* builtin_def(lenv* e, lval* a);
+lval* builtin_put(lenv* e, lval* a);
+lval* builtin_if(lenv* e, lval* a);
+lval* builtin_eq(lenv* e, lval* a);
+lval* builtin_ne(lenv* e, lval* a);
+lval* builtin_gt(lenv* e, lval* a);
+lval* builtin_lt(lenv* e, lval* a);
+lval* builtin_ge(lenv* e, lval* a);
+lval* builtin_le(lenv* e, lval* a);
+lval* builtin_error(lenv* e, lval* a);
+lval* builtin_try(lenv* e, lval* a);
+lval* builtin_budget(lenv* e, lval* a);
+lval* builtin_mem_usage(lenv* e, lval* a);
+lval* builtin_memo(lenv* e, lval* a);
+lval* builtin_memo_stats(lenv* e, lval* a);
+lval* builtin_pmap(lenv* e, lval* a);
+lval* builtin_preduce(lenv* e, lval* a);
+lval* builtin_par(lenv* e, lval* a);
+lval* builtin_spawn(lenv* e, lval* a);
+lval* builtin_await(lenv* e, lval* a);
+lval* builtin_spawn_green(lenv* e, lval* a);
+lval* builtin_yield(lenv* e, lval* a);
+lval* builtin_chan(lenv* e, lval* a);
+lval* builtin_send(lenv* e, lval* a);
+lval* builtin_recv(lenv* e, lval* a);
+lval* builtin_select(lenv* e, lval* a);
+lval* builtin_close(lenv* e, lval* a);
+lval* builtin_actor(lenv* e, lval* a);
+
+#define LBUILTIN_COUNT 50
+#define LBUILTIN_SLOTS 63
+#define LBUILTIN_BUCKETS 26
+
+/* Multiplier of the second hash for each bucket, as (m - 33) / 2 */
+static const unsigned short lbuiltin_disp[LBUILTIN_BUCKETS] = {
+	3, 8, 2, 1, 0, 2, 6, 0, 18, 2, 0, 0, 0, 2, 1, 3,
+	12, 0, 0, 0, 0, 5, 0, 34, 0, 0
+};
+
+static const lbuiltin_def lbuiltin_table[LBUILTIN_SLOTS] = {
+	{"-", builtin_sub, 18},
+	{NULL, NULL, 0},
+	{"/", builtin_div, 20},
+	{"if", builtin_if, 24},
+	{"head", builtin_head, 1},
+	{"list", builtin_list, 0},
+	{"memo", builtin_memo, 35},
+	{NULL, NULL, 0},
+	{NULL, NULL, 0},
+	{"reverse", builtin_reverse, 7},
+	{"recv", builtin_recv, 46},
+	{NULL, NULL, 0},
+	{"\\", builtin_lambda, 21},
+	{"memo-stats", builtin_memo_stats, 36},
+	{NULL, NULL, 0},
+	{"<", builtin_lt, 28},
+	{"+", builtin_add, 17},
+	{"eval", builtin_eval, 3},
+	{"foldr", builtin_foldr, 12},
+	{"len", builtin_len, 5},
+	{"preduce", builtin_preduce, 38},
+	{"lazy-range", builtin_lazy_range, 13},
+	{"filter", builtin_filter, 10},
+	{"!=", builtin_ne, 26},
+	{"error", builtin_error, 31},
+	{">=", builtin_ge, 29},
+	{"range", builtin_range, 8},
+	{"nth", builtin_nth, 6},
+	{"pmap", builtin_pmap, 37},
+	{NULL, NULL, 0},
+	{"mem-usage", builtin_mem_usage, 34},
+	{"send", builtin_send, 45},
+	{NULL, NULL, 0},
+	{NULL, NULL, 0},
+	{"=", builtin_put, 23},
+	{"close", builtin_close, 48},
+	{NULL, NULL, 0},
+	{NULL, NULL, 0},
+	{"join", builtin_join, 4},
+	{"def", builtin_def, 22},
+	{"select", builtin_select, 47},
+	{"iterate", builtin_iterate, 14},
+	{"foldl", builtin_foldl, 11},
+	{"collect", builtin_collect, 16},
+	{"take", builtin_take, 15},
+	{">", builtin_gt, 27},
+	{"map", builtin_map, 9},
+	{"==", builtin_eq, 25},
+	{"par", builtin_par, 39},
+	{"tail", builtin_tail, 2},
+	{"spawn-green", builtin_spawn_green, 42},
+	{"*", builtin_mul, 19},
+	{"<=", builtin_le, 30},
+	{NULL, NULL, 0},
+	{"chan", builtin_chan, 44},
+	{"yield", builtin_yield, 43},
+	{NULL, NULL, 0},
+	{"spawn", builtin_spawn, 40},
+	{"try", builtin_try, 32},
+	{NULL, NULL, 0},
+	{"actor", builtin_actor, 49},
+	{"budget", builtin_budget, 33},
+	{"await", builtin_await, 41},
+};
@@ -0,0 +1,108 @@
+# Generate builtins.h from builtins.def: a perfect hash of the builtin
+# names, so an interpreter finds its builtins without building a table.
+#
+# Names are hashed twice with lbuiltin_hash in tlisp.c, in 32 bits. The first hash
+# picks a bucket, and each bucket has a multiplier for the second hash,
+# searched here so that every name lands on a slot of its own.
+#
+#   awk -f gen-builtins.awk builtins.def > builtins.h
+
+function hash(s, m,    h, i) {
+	h = m
+	for (i = 1; i <= length(s); i++) {
+		h = (h * m + ord[substr(s, i, 1)]) % 4294967296
+	}
+	return h
+}
+
+BEGIN {
+	for (i = 1; i < 256; i++) {ord[sprintf("%c", i)] = i}
+	n = 0
+}
+
+/^[ \t]*(#|$)/ {next}
+
+{
+	name[n] = $1
+	fn[n] = $2
+	n++
+}
+
+END {
+	# An odd number of slots, as the multipliers are odd and powers of two
+	# in the slot count would leave some names few slots to choose from
+	slots = n + int(n / 4) + 1
+	if (slots % 2 == 0) {slots++}
+	buckets = int(n / 2) + 1
+
+	for (b = 0; b < buckets; b++) {size[b] = 0}
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i; j++) {
+			if (name[j] == name[i]) {
+				print "gen-builtins.awk: '" name[i] "' is defined twice" > "/dev/stderr"
+				exit 1
+			}
+		}
+		b = hash(name[i], 31) % buckets
+		member[b, size[b]++] = i
+	}
+	for (s = 0; s < slots; s++) {taken[s] = -1}
+
+	# Place the fullest buckets first, while most slots are free
+	for (left = n; left > 0; ) {
+		best = -1
+		for (b = 0; b < buckets; b++) {
+			if (!(b in disp) && (best < 0 || size[b] > size[best])) {best = b}
+		}
+		b = best
+		for (d = 0; ; d++) {
+			if (d > 4095) {
+				print "gen-builtins.awk: no multiplier for bucket " b > "/dev/stderr"
+				exit 1
+			}
+			ok = 1
+			for (k = 0; k < size[b] && ok; k++) {
+				s = hash(name[member[b, k]], 2 * d + 33) % slots
+				if (taken[s] >= 0) {ok = 0}
+				for (j = 0; j < k && ok; j++) {
+					if (slot[member[b, j]] == s) {ok = 0}
+				}
+				slot[member[b, k]] = s
+			}
+			if (ok) {break}
+		}
+		disp[b] = d
+		for (k = 0; k < size[b]; k++) {taken[slot[member[b, k]]] = member[b, k]}
+		left -= size[b]
+	}
+
+	print "/* Generated from builtins.def by gen-builtins.awk, do not edit */"
+	for (i = 0; i < n; i++) {print "lval* " fn[i] "(lenv* e, lval* a);"}
+	print ""
+	print "#define LBUILTIN_COUNT " n
+	print "#define LBUILTIN_SLOTS " slots
+	print "#define LBUILTIN_BUCKETS " buckets
+	print ""
+	print "/* Multiplier of the second hash for each bucket, as (m - 33) / 2 */"
+	printf "static const unsigned short lbuiltin_disp[LBUILTIN_BUCKETS] = {"
+	for (b = 0; b < buckets; b++) {
+		printf "%s%s%d", (b ? "," : ""), (b % 16 ? " " : "\n\t"), disp[b]
+	}
+	print "\n};"
+	print ""
+	print "static const lbuiltin_def lbuiltin_table[LBUILTIN_SLOTS] = {"
+	for (s = 0; s < slots; s++) {
+		i = taken[s]
+		if (i < 0) {
+			print "\t{NULL, NULL, 0},"
+		} else {
+			q = ""
+			for (k = 1; k <= length(name[i]); k++) {
+				c = substr(name[i], k, 1)
+				q = q (c == "\\" || c == "\"" ? "\\" : "") c
+			}
+			print "\t{\"" q "\", " fn[i] ", " i "},"
+		}
+	}
+	print "};"
+}
@@ -0,0 +1,95 @@
+#include "tlisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#ifdef  _WIN32
+static char buffer[2048];
+
+char * readline(char* prompt)
+{
+	fputs(prompt, stdout);
+	fgets(buffer, 2048, stdin);
+	char* cpy = malloc(strlen(buffer)+1);
+	strcpy(cpy, buffer);
+	cpy[strlen(cpy)-1] = '\0';
+	return cpy;
+}
+void add_history(char* unused) {}
+#else
+#include <editline.h>
+#endif
+
+/* Interpreter that ctrl+c stops */
+static tlisp_state_t* volatile sigint_state = NULL;
+
+/* ctrl+c stops the running evaluation, or leaves at the prompt */
+void sigint(int sig)
+{
+	tlisp_state_t* s = sigint_state;
+	if (!s || !tlisp_interrupt(s)) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	tlisp_state_t* s = tlisp_state_new();
+
+	/* parse command line flags */
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--dump-opt") == 0) { tlisp_set(s, TLISP_OPT_DUMP_OPT, 1); }
+		if (strcmp(argv[i], "--no-vm") == 0) { tlisp_set(s, TLISP_OPT_VM, TLISP_VM_OFF); }
+		if (strcmp(argv[i], "--vm-switch") == 0) { tlisp_set(s, TLISP_OPT_VM, TLISP_VM_SWITCH); }
+		if (strcmp(argv[i], "--no-jit") == 0) { tlisp_set(s, TLISP_OPT_JIT, 0); }
+		if (strcmp(argv[i], "--inline-size") == 0 && i+1 < argc) {
+			tlisp_set(s, TLISP_OPT_INLINE_SIZE, atoi(argv[++i]));
+		}
+		if (strcmp(argv[i], "--fuel") == 0 && i+1 < argc) {
+			tlisp_set(s, TLISP_OPT_FUEL, atol(argv[++i]));
+		}
+		if (strcmp(argv[i], "--deadline") == 0 && i+1 < argc) {
+			tlisp_set(s, TLISP_OPT_DEADLINE, atol(argv[++i]));
+		}
+		if (strcmp(argv[i], "--mem-limit") == 0 && i+1 < argc) {
+			tlisp_set(s, TLISP_OPT_MEM_LIMIT, strtoul(argv[++i], NULL, 10));
+		}
+		if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+			tlisp_set(s, TLISP_OPT_THREADS, atoi(argv[++i]));
+		}
+	}
+
+	/* print version and exit information */
+	puts("tlisp version 0.0.0.0.7");
+	puts("press ctrl+c to stop an evaluation, ctrl+d to exit\n");
+
+	sigint_state = s;
+	signal(SIGINT, sigint);
+	/* infinite loop */
+	for (;;)
+	{
+		/* output our prompt */
+		char* input = readline("tlisp> ");
+		/* end of input, such as a script piped in */
+		if (!input) { break; }
+		add_history(input);
+
+		tlisp_value_t* x = tlisp_eval_buffer(s, "<stdin>", input, strlen(input));
+		if (tlisp_type(x) == TLISP_ERROR && tlisp_error_code(x) == TLISP_ERR_PARSE) {
+			/* the parser's message already says where it failed */
+			fputs(tlisp_error_msg(s, x), stdout);
+		} else {
+			tlisp_println(s, x);
+		}
+		tlisp_free(s, x);
+		/* free retrieved input */
+		free(input);
+	}
+	sigint_state = NULL;
+	tlisp_state_del(s);
+
+	return 0;
+}
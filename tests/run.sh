@@ -0,0 +1,18 @@
+#!/bin/sh
+# Run each tests/*.tl through the REPL with 1, 2 and 4 worker threads, on the
+# VM and off it, and compare what it prints with the matching .out file.
+cd "$(dirname "$0")/.." || exit 1
+fail=0
+for f in tests/*.tl; do
+	for t in 1 2 4; do
+		for m in "" --no-vm; do
+			out=$(timeout 60 ./main --threads $t $m < "$f" 2>&1 | tail -n +4)
+			if [ "$out" != "$(cat "${f%.tl}.out")" ]; then
+				echo "FAIL $f --threads $t $m"
+				fail=1
+			fi
+		done
+	done
+done
+[ $fail = 0 ] && echo "all passed"
+exit $fail
@@ -1,64 +1,117 @@
+#define _DEFAULT_SOURCE
+#include "tlisp.h"
 #include "mpc.h"
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
 
 /* Macros for Error Checking */
 #define LASSERT(args, cond, fmt, ...) \
-	if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
+	LASSERT_CODE(args, cond, LERR_OTHER, fmt, ##__VA_ARGS__)
+#define LASSERT_CODE(args, cond, code, fmt, ...) \
+	if (!(cond)) { lval* err = lval_error(code, fmt, ##__VA_ARGS__); lval_del(args); return err; }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-	LASSERT(args, args->cell[index]->type == expect, \
+	LASSERT_CODE(args, args->cell[index]->type == expect, LERR_TYPE, \
 		"Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
 		func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
 #define LASSERT_NUM(func, args, num)  \
-	LASSERT(args, args->count == num, \
+	LASSERT_CODE(args, args->count == num, LERR_ARGS, \
 		"Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
 		func, args->count, num)
 #define LASSERT_NOT_EMPTY(func, args, index) \
-	LASSERT(args, args->cell[index]->count != 0, \
+	LASSERT_CODE(args, args->cell[index]->count != 0, LERR_EMPTY, \
 		"Function '%s' passed {} for argument %i.", func, index);
 
-		
 
-#ifdef  _WIN32
-static char buffer[2048];
+/* The template JIT writes x86-64 into mmap'd pages */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_WIN32)
+#define LVM_JIT
+#include <sys/mman.h>
+#endif
 
-char * readline(char* prompt)
-{
-	fputs(prompt, stdout);
-	fgets(buffer, 2048, stdin);
-	char* cpy = malloc(strlen(buffer)+1);
-	strcpy(cpy, buffer);
-	cpy[strlen(cpy)-1] = '\0';
-	return cpy;
-}
-void add_history(char* unused) {}
-#else 
-#include <editline.h>
+/* Parallel builtins run on a pool of POSIX threads */
+#if !defined(_WIN32) && defined(__GNUC__)
+#define LPOOL
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* Green threads switch between C stacks with ucontext */
+#if defined(LPOOL) && defined(__linux__)
+#define LGREEN
+#include <ucontext.h>
+#include <sys/mman.h>
 #endif
 
 struct lval;
 struct lenv;
+struct lmemo;
+struct lseq;
+struct lcode;
+struct lfeed;
+struct lerr;
+struct lfuture;
+struct lchan;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lmemo lmemo;
+typedef struct lseq lseq;
+typedef struct lcode lcode;
+typedef struct lfeed lfeed;
+typedef struct lerr lerr;
+typedef struct lfuture lfuture;
+typedef struct lchan lchan;
 /* Lisp Value */
-enum {LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR};
+enum {LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_SEQ, LVAL_FUT, LVAL_CHAN};
 typedef lval*(*lbuiltin)(lenv*, lval*);
+
+/* A builtin of every interpreter, and its index in the interpreter's 'builtins' */
+typedef struct lbuiltin_def
+{
+	const char* name;
+	lbuiltin fn;
+	int id;
+} lbuiltin_def;
+#include "builtins.h"
+
 /* New lval Struct */
 struct lval
 {
 	int type;
 	/* Basic */
 	long num;
-	char* err;
+	lerr* err;
 	char* sym;
 	/* function */
 	lbuiltin builtin;
 	lenv* env;
 	lval* formals;
 	lval* body;
+	/* body before optimization and the globals the rewrite relied on */
+	lval* orig;
+	lval* deps;
+	int epoch;
+	/* bytecode shared by every copy of a lambda */
+	lcode* code;
+	/* memoized wrapper around another function */
+	lmemo* memo;
+	/* calls running this function in place, and whether it lost its binding */
+	int pins;
+	int unbound;
+	/* lazy sequence */
+	lseq* seq;
+	/* evaluation running elsewhere */
+	lfuture* fut;
+	/* channel between evaluations */
+	lchan* chan;
 
 	/* expressions */
 	int count;
 	lval** cell;
+	/* operand types seen at this call site, shared by copies */
+	lfeed* feed;
 };
 
 struct lenv
@@ -69,84 +122,531 @@ struct lenv
 	lval** vals;
 };
 
+/* Cache entry, chained per bucket and linked in least recently used order */
+struct lmemo_entry;
+typedef struct lmemo_entry lmemo_entry;
+struct lmemo_entry
+{
+	unsigned long hash;
+	lval* args;
+	lval* val;
+	lmemo_entry* chain;
+	lmemo_entry* newer;
+	lmemo_entry* older;
+};
+
+struct lmemo
+{
+	int refs;
+	lval* fun;
+	/* Bounded hash table of argument lists */
+	long cap;
+	long count;
+	long nbuckets;
+	lmemo_entry** buckets;
+	/* Most and least recently used entries */
+	lmemo_entry* newest;
+	lmemo_entry* oldest;
+	long hits;
+	long misses;
+};
+
+/*
+ * Lazy sequence, an immutable description shared by all copies. Elements
+ * are produced one at a time by an lseq_iter, so consuming a sequence
+ * never holds more than one element per stage of the pipeline.
+ */
+enum {LSEQ_RANGE, LSEQ_ITERATE, LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE};
+
+struct lseq
+{
+	int refs;
+	int kind;
+	/* range bounds, or the count for take */
+	long start;
+	long end;
+	long step;
+	/* function for iterate, map and filter, seed for iterate */
+	lval* fun;
+	lval* init;
+	lseq* src;
+};
+
+struct lseq_iter;
+typedef struct lseq_iter lseq_iter;
+struct lseq_iter
+{
+	lseq* s;
+	long i;
+	lval* cur;
+	lseq_iter* src;
+};
+
+enum {LCODE_NEW, LCODE_COMPILING, LCODE_READY, LCODE_NONE};
+
+/* An opcode, an operand, or a label address once threaded */
+typedef union {long i; void* p;} lins;
+
+struct lsite;
+typedef struct lsite lsite;
+struct lsite
+{
+	lcode* target;
+	int argc;
+};
+
+struct lcode
+{
+	int refs;
+	int state;
+	/* def_epoch and global count the state was decided under */
+	int epoch;
+	int globals;
+	int nargs;
+	int maxstack;
+	int count;
+	lins* ops;
+	/* 'ops' with every opcode replaced by its label address */
+	lins* thr;
+	int nsites;
+	lsite* sites;
+	/* Calls counted towards LVM_JIT_HOT, and native code once hot */
+	long calls;
+	void* jit;
+	size_t jitsize;
+};
+
+/* Kind of an error, independent of its message */
+enum {LERR_OTHER, LERR_UNBOUND, LERR_TYPE, LERR_ARGS, LERR_EMPTY,
+	LERR_RANGE, LERR_DIV_ZERO, LERR_OVERFLOW, LERR_NUMBER, LERR_USER, LERR_LIMIT,
+	LERR_INTERRUPT, LERR_PARSE};
+
+/* tlisp.h numbers types and error codes the same way */
+typedef char lapi_check[(int)LVAL_CHAN == (int)TLISP_CHANNEL && (int)LERR_PARSE == (int)TLISP_ERR_PARSE ? 1 : -1];
+
+#define LERR_ARGC 6
+
+/*
+ * An error keeps its format and raw operands, and is only turned into
+ * text when shown. String operands are copied into 'text', which is
+ * allocated along with it.
+ */
+struct lerr
+{
+	int code;
+	/* a string literal */
+	char* fmt;
+	int argc;
+	/* numbers, or offsets of strings in 'text' */
+	long args[LERR_ARGC];
+	char* msg;
+	int size;
+	char text[];
+};
+
+/* Type feedback of an arithmetic call site in a lambda body */
+enum {LFEED_COLD, LFEED_NUM, LFEED_GENERIC};
+
+struct lfeed
+{
+	int refs;
+	int state;
+	/* Calls seen with only numbers, and guard failures */
+	int hits;
+	int misses;
+	/* Builtin the site was specialized for */
+	lbuiltin fn;
+};
+
+/* VM dispatch */
+enum {LVM_OFF, LVM_SWITCH, LVM_THREADED};
+
+struct lvm_frame;
+typedef struct lvm_frame lvm_frame;
+#ifdef LVM_JIT
+typedef int (*ljit_entry)(void* fn, long* sp, long* out, long* send, void* stack);
+#endif
+
+/*
+ * Interpreter state: everything an interpreter changes as it runs, so
+ * that many can live in one process, on one thread or on several. Code
+ * reaches the interpreter of its thread through 'lstate', which
+ * tlisp_enter sets.
+ */
+/* A builtin registered through tlisp_register */
+typedef struct lnative
+{
+	tlisp_builtin fn;
+	void* data;
+} lnative;
+
+struct lpool;
+struct lgroup;
+struct lgreen;
+typedef struct lpool lpool;
+typedef struct lgroup lgroup;
+typedef struct lgreen lgreen;
+
+struct tlisp_state
+{
+	/* Bytecode settings */
+	/* Dispatch used by the VM (--no-vm, --vm-switch) */
+	int lvm_mode;
+	/* Compile hot code to native code (--no-jit) */
+	int lvm_jit_on;
+
+	/* Optimizer settings */
+	/* Print lambda bodies after optimization (--dump-opt) */
+	int opt_dump;
+	/* Largest body, in nodes, spliced into callers (--inline-size) */
+	int opt_inline_size;
+	/* Bumped whenever an existing global binding is replaced */
+	int def_epoch;
+
+	/* Budget of each top-level evaluation */
+	/* Steps allowed, or 0 for no limit (--fuel, 'budget') */
+	long budget_fuel;
+	/* Wall-clock milliseconds allowed, or 0 for no limit (--deadline, 'budget') */
+	long budget_ms;
+	/* Steps left before the budget is polled */
+	long budget_tick;
+	/* Steps given out by the last refill, and steps charged so far */
+	long budget_chunk;
+	long budget_used;
+	/* Deadline in ms on the monotonic clock, or 0 */
+	long budget_end;
+	int budget_out;
+	/* Whether a top-level evaluation runs, and whether tlisp_interrupt stopped it */
+	volatile sig_atomic_t budget_busy;
+	volatile sig_atomic_t budget_interrupt;
+	/* The interpreter this one runs in place for, whose interrupts stop it too */
+	tlisp_state_t* budget_outer;
+
+	/* Bytes allowed, or 0 for no limit (--mem-limit) */
+	size_t mem_limit;
+	size_t mem_used;
+	size_t mem_peak;
+	/* Set when an allocation went over the limit */
+	int mem_over;
+	/* The interpreter made by tlisp_state_new that this one works under */
+	tlisp_state_t* root;
+	/* At the root: bytes of every channel made under it, and of the values queued in them */
+	size_t mem_chans;
+
+	/* Value stack and call frames of the VM */
+	long* lvm_stack;
+	lvm_frame* lvm_frames;
+#ifdef LVM_JIT
+	/* Trampoline into native code, and the exit errors jump to */
+	ljit_entry ljit_enter;
+	unsigned char* ljit_exit;
+	size_t ljit_size;
+	/* Host stack pointer and result pointer saved by 'ljit_enter' */
+	void* ljit_rsp;
+	long* ljit_out;
+	unsigned char* ljit_stack;
+#endif
+
+	/* Grammar and global environment */
+	mpc_parser_t* number;
+	mpc_parser_t* symbol;
+	mpc_parser_t* sexpr;
+	mpc_parser_t* qexpr;
+	mpc_parser_t* expr;
+	mpc_parser_t* tlisp;
+	lenv* env;
+	/* Values of the builtins in builtins.h, indexed by their id */
+	lval builtins[LBUILTIN_COUNT];
+	/* Builtins registered by the embedder, indexed by 'num' of their lval */
+	lnative* natives;
+	int nnatives;
+	/* Bumped whenever a global binding is added or replaced */
+	int env_gen;
+
+	/* Worker pool of the parallel builtins, started on first use */
+	/* Threads in it, or 0 for one per processor (--threads) */
+	int pool_size;
+	lpool* pool;
+	/* On a worker: the interpreter it works for, the work it runs and the item of it */
+	tlisp_state_t* owner;
+	lgroup* group;
+	long group_at;
+	/* Green thread evaluating in this interpreter, while one does */
+	lgreen* green;
+};
+
+/* Interpreter of the calling thread */
+#ifdef _MSC_VER
+static __declspec(thread) tlisp_state_t* lstate = NULL;
+#else
+static __thread tlisp_state_t* lstate = NULL;
+#endif
+
+/* Memory */
+/*
+ * Everything the interpreter allocates for values, environments and
+ * compiled code goes through lmalloc, which keeps the size in front of
+ * each block. Going over the limit doesn't fail the allocation itself:
+ * it makes the next step poll the budget, which stops the evaluation with
+ * "memory limit exceeded" and frees its temporaries on the way out.
+ */
+typedef union lmem_head
+{
+	size_t size;
+	long l;
+	double d;
+	void* p;
+} lmem_head;
+
+void lbudget_wake(void);
+
+/* Bytes counted against the limit: this interpreter's, and those of the channels it shares */
+size_t lmem_used(tlisp_state_t* s)
+{
+#ifdef LPOOL
+	return s->mem_used + __atomic_load_n(&s->root->mem_chans, __ATOMIC_RELAXED);
+#else
+	return s->mem_used + s->root->mem_chans;
+#endif
+}
+
+void lmem_charge(long n)
+{
+	lstate->mem_used += n;
+	if (lstate->mem_used > lstate->mem_peak) {lstate->mem_peak = lstate->mem_used;}
+	if (lstate->mem_limit && lmem_used(lstate) > lstate->mem_limit && !lstate->mem_over) {
+		lstate->mem_over = 1;
+		lbudget_wake();
+	}
+}
+
+/* Count a block of 'n' bytes fresh from malloc, and return its data */
+void* lmem_take(lmem_head* h, size_t n)
+{
+	if (!h) {
+		fputs("tlisp: out of memory\n", stderr);
+		exit(1);
+	}
+	h->size = n;
+	lmem_charge(n);
+	return h + 1;
+}
+
+void* lmalloc(size_t n)
+{
+	return lmem_take(malloc(sizeof(lmem_head) + n), n);
+}
+
+void* lcalloc(size_t count, size_t n)
+{
+	void* p = lmalloc(count * n);
+	memset(p, 0, count * n);
+	return p;
+}
+
+void lfree(void* p)
+{
+	if (!p) {return;}
+	lmem_head* h = (lmem_head*)p - 1;
+	lstate->mem_used -= h->size;
+	free(h);
+}
+
+void* lrealloc(void* p, size_t n)
+{
+	if (!p) {return lmalloc(n);}
+	/* Shrinking to nothing frees, as glibc's realloc does */
+	if (!n) {lfree(p); return NULL;}
+	lmem_head* h = (lmem_head*)p - 1;
+	lstate->mem_used -= h->size;
+	return lmem_take(realloc(h, sizeof(lmem_head) + n), n);
+}
+
+/* Whether 'count' more blocks of 'size' bytes stay within the limit */
+int lmem_fits(size_t count, size_t size)
+{
+	tlisp_state_t* s = lstate;
+	size_t used = lmem_used(s);
+	return !s->mem_limit || (used <= s->mem_limit && count <= (s->mem_limit - used) / size);
+}
+
 /* Pointer Constructors */
 /* New number type lval */
 lval* lval_num(long x) 
 {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lmalloc(sizeof(lval));
 	v->type = LVAL_NUM;
 	v->num = x;
 	return v;
 }
-/* Pointer to a new Error lval */
-lval* lval_err(char* fmt, ...)
+/* Pointer to a new Error lval with 'code', formatted only when shown */
+lval* lval_errorv(int code, char* fmt, va_list va)
 {
-	lval* v = malloc(sizeof(lval)); 
+	/* Measure the string operands first */
+	va_list vs;
+	va_copy(vs, va);
+	int size = 0;
+	for (char* p = fmt; *p; p++)
+	{
+		if (*p != '%' || *++p == '%') {continue;}
+		int wide = 0;
+		while (*p == 'l') {wide = 1; p++;}
+		if (*p == 's') {
+			size += strlen(va_arg(vs, char*)) + 1;
+		} else if (wide) {
+			va_arg(vs, long);
+		} else {
+			va_arg(vs, int);
+		}
+	}
+	va_end(vs);
+
+	lerr* r = lmalloc(sizeof(lerr) + size);
+	r->code = code;
+	r->fmt = fmt;
+	r->argc = 0;
+	r->msg = NULL;
+	r->size = size;
+	int used = 0;
+	for (char* p = fmt; *p; p++)
+	{
+		if (*p != '%' || *++p == '%') {continue;}
+		int wide = 0;
+		while (*p == 'l') {wide = 1; p++;}
+		long x;
+		if (*p == 's') {
+			char* str = va_arg(va, char*);
+			strcpy(r->text + used, str);
+			x = used;
+			used += strlen(str) + 1;
+		} else {
+			x = wide ? va_arg(va, long) : va_arg(va, int);
+		}
+		if (r->argc < LERR_ARGC) {r->args[r->argc++] = x;}
+	}
+
+	lval* v = lmalloc(sizeof(lval));
 	v->type = LVAL_ERR;
-	/* Create a valist and initialize it */
+	v->err = r;
+	return v;
+}
+
+lval* lval_error(int code, char* fmt, ...)
+{
 	va_list va;
 	va_start(va, fmt);
-
-	/* Allocate 512 bytes of space */
-	v->err = malloc(512);
-	/* printf the error string with a maximum of 511 chars */
-	vsnprintf(v->err, 511, fmt, va);
-	/* Reallocate to number of bytes actually used */
-	v->err = realloc(v->err, strlen(v->err)+1);
-	/* Cleanup */
+	lval* v = lval_errorv(code, fmt, va);
 	va_end(va);
+	return v;
+}
 
+/* Pointer to a new Error lval */
+lval* lval_err(char* fmt, ...)
+{
+	va_list va;
+	va_start(va, fmt);
+	lval* v = lval_errorv(LERR_OTHER, fmt, va);
+	va_end(va);
 	return v;
+}
+
+/* The message of error 'r', formatted on first use */
+char* lerr_msg(lerr* r)
+{
+	if (r->msg) {return r->msg;}
+	r->msg = lmalloc(strlen(r->fmt) + r->size + 24 * r->argc + 1);
+	char* out = r->msg;
+	int arg = 0;
+	for (char* p = r->fmt; *p; p++)
+	{
+		if (*p != '%') {*out++ = *p; continue;}
+		if (*++p == '%') {*out++ = '%'; continue;}
+		while (*p == 'l') {p++;}
+		if (arg >= r->argc) {continue;}
+		long x = r->args[arg++];
+		if (*p == 's') {
+			out += sprintf(out, "%s", r->text + x);
+		} else {
+			out += sprintf(out, "%li", x);
+		}
+	}
+	*out = '\0';
+	return r->msg;
+}
 
+lerr* lerr_copy(lerr* r)
+{
+	lerr* x = lmalloc(sizeof(lerr) + r->size);
+	memcpy(x, r, sizeof(lerr) + r->size);
+	if (r->msg) {
+		x->msg = lmalloc(strlen(r->msg) + 1);
+		strcpy(x->msg, r->msg);
+	}
+	return x;
 }
 /* Pointer constructor to a new Symbol lval */
 lval* lval_sym(char* s)
 {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lmalloc(sizeof(lval));
 	v->type = LVAL_SYM;
-	v->sym = malloc(strlen(s) + 1);
+	v->sym = lmalloc(strlen(s) + 1);
 	strcpy(v->sym, s);
 	return v;
 }
 /* Pointer to a new empty Sexpr lval */
 lval* lval_sexpr(void) 
 {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lmalloc(sizeof(lval));
 	v->type = LVAL_SEXPR;
 	v->count = 0;
 	v->cell = NULL;
+	v->feed = NULL;
 	return v;
 }
 /* Pointer to new empty Qexpr lval */
 lval* lval_qexpr(void)
 {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lmalloc(sizeof(lval));
 	v->type = LVAL_QEXPR;
 	v->count = 0;
 	v->cell = NULL;
+	v->feed = NULL;
 	return v;
 }
 /* Constructor to function for lbuiltin */
 lval* lval_fun(lbuiltin func)
 {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lmalloc(sizeof(lval));
 	v->type = LVAL_FUN;
 	v->builtin = func;
+	v->num = 0;
+	v->memo = NULL;
+	v->pins = 0;
+	v->unbound = 0;
 	return v;
 }
 lenv* lenv_new(void);
+lcode* lcode_new(void);
 /* Constructor for user defined lval functions */
 lval* lval_lambda(lval* formals, lval* body)
 {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lmalloc(sizeof(lval));
 	v->type = LVAL_FUN;
 	/* Set Builtin to Num */
 	v->builtin = NULL;
+	v->memo = NULL;
+	v->pins = 0;
+	v->unbound = 0;
 	/* Build new environment */
 	v->env = lenv_new();
 	/* Set Formals and Body */
 	v->formals = formals;
 	v->body = body;
+	/* Not optimized or compiled yet */
+	v->orig = NULL;
+	v->deps = NULL;
+	v->epoch = lstate->def_epoch;
+	v->code = lcode_new();
 	return v;
 }
 
@@ -154,19 +654,23 @@ lval* lval_lambda(lval* formals, lval* body)
 /* Function Prototypes */
 void lval_del(lval* v);
 void lenv_del(lenv* e);
+void lenv_clear(lenv* e);
+void lval_unbind(lval* v);
 lval* lval_add(lval* v, lval* x);
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
 void lenv_put(lenv* e, lval* k, lval* v);
 lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_apply(lenv* e, lval* f, lval* a);
+lval* lval_apply_in(lenv* e, lval* f, lenv* env, lval* a);
+void lenv_bind(lenv* e, char* s, lval* v);
 
 void lval_print(lval* v);
 void lval_expr_print(lval* v, char open, char close);
 void lval_println(lval* v) {lval_print(v); putchar('\n');}
 
 lenv* lenv_copy(lenv* e);
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
-void lenv_add_builtins(lenv* e);
+lval* lbuiltin_find(char* s);
 
 char* ltype_name(int t);
 lval* builtin_op(lenv* e, lval* a, char* op);
@@ -175,6 +679,11 @@ lval* builtin_list(lenv* e, lval* a);
 lval* builtin_head(lenv* e, lval* a);
 lval* builtin_tail(lenv* e, lval* a);
 lval* builtin_def(lenv* e, lval* a);
+lval* builtin_put(lenv* e, lval* a);
+lval* builtin_ord(lenv* e, lval* a, char* op);
+lval* builtin_cmp(lenv* e, lval* a, char* op);
+lval* builtin_if(lenv* e, lval* a);
+int lval_eq(lval* x, lval* y);
 
 lval* lval_lambda(lval* formals, lval* body);
 lval* lval_join(lval* x, lval* y);
@@ -187,63 +696,37 @@ lval* lval_read_num(mpc_ast_t* t);
 lval* lval_read(mpc_ast_t* t);
 lval* lval_eval(lenv* e, lval* v);
 lval* lval_eval_sexpr(lenv* e, lval* v);
+lval* lval_call_sexpr(lenv* e, lval* v);
 
-int main(int argc, char** argv)
-{
-
-	/* create some parsers */
-	mpc_parser_t* Number	= mpc_new("number");
-	mpc_parser_t* Symbol	= mpc_new("symbol");
-	mpc_parser_t* Sexpr		= mpc_new("sexpr");
-	mpc_parser_t* Qexpr		= mpc_new("qexpr");
-	mpc_parser_t* Expr		= mpc_new("expr");
-	mpc_parser_t* tLisp		= mpc_new("tlisp");
-
-	/* define them with the following language */
-	mpca_lang(MPCA_LANG_DEFAULT,									
-		"															\
-			number	: /-?[0-9]+/ ;									\
-	    	symbol	: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;			\
-			sexpr	: '(' <expr>* ')' ;								\
-			qexpr	: '{' <expr>* '}' ;								\
-			expr	: <number> | <symbol> | <sexpr> | <qexpr> ;		\
-			tlisp	: /^/ <expr>* /$/ ;								\
-		", Number, Symbol, Sexpr, Qexpr, Expr, tLisp);
-
-
-	/* print version and exit information */
-	puts("tlisp version 0.0.0.0.7");
-	puts("press ctrl+c to exit\n");
-
-	lenv* e = lenv_new();
-	lenv_add_builtins(e);
-	/* infinite loop */
-	for (;;)
-	{
-		/* output our prompt */
-		char* input = readline("tlisp> ");
-		add_history(input); 
-
-		mpc_result_t r;
-		if (mpc_parse("<stdin>", input, tLisp, &r)) 
-		{
-			lval* x = lval_eval(e, lval_read(r.output));
-			lval_println(x);
-			lval_del(x);
-
-			mpc_ast_delete(r.output);
-		} else {
-			/* otherwise print the error */
-			mpc_err_print(r.error);
-			mpc_err_delete(r.error);
-		}
-		/* free retrieved input */
-		free(input);
-	}
-	lenv_del(e);
+lval* lval_optimize(lenv* e, lval* formals, lval* body, lval** deps);
+void lval_fun_optimize(lenv* e, lval* f);
+void lval_feed_attach(lval* v);
+void lenv_deopt(lenv* e, lval* syms);
 
-	return 0;
-}
+unsigned long lval_hash(lval* v);
+lval* lmemo_call(lenv* e, lmemo* m, lval* a);
+void lmemo_release(lmemo* m);
+void lseq_release(lseq* s);
+void lcode_release(lcode* c);
+lval* lvm_call(lenv* e, lval* f, lval* a);
+void lbudget_begin(void);
+void lbudget_end(void);
+int lbudget_poll(void);
+lval* lbudget_error(void);
+lval* lseq_next(lenv* e, lseq_iter* it);
+lval* builtin_memo(lenv* e, lval* a);
+lval* builtin_memo_stats(lenv* e, lval* a);
+lval* builtin_native(lenv* e, lval* a);
+int lgroup_stop(lgroup* g, long i);
+int lgroup_spend(lgroup* g, long n);
+void lpool_del(lpool* p);
+void lfuture_hold(lfuture* f);
+void lfuture_drop(lfuture* f);
+int lfuture_is_actor(lfuture* f);
+void lchan_hold(lchan* c);
+void lchan_drop(lchan* c);
+void lchan_close(lchan* c);
+tlisp_state_t* tlisp_enter(tlisp_state_t* s);
 
 void lval_del(lval* v)
 {
@@ -251,13 +734,21 @@ void lval_del(lval* v)
 		/* do nothing special for num type */
 		case LVAL_NUM: break;
 		/* for err or sym free the string data */
-		case LVAL_ERR: free(v->err); break;
-		case LVAL_SYM: free(v->sym); break;
+		case LVAL_ERR: lfree(v->err->msg); lfree(v->err); break;
+		case LVAL_SYM: lfree(v->sym); break;
+		case LVAL_SEQ: lseq_release(v->seq); break;
+		case LVAL_FUT: lfuture_drop(v->fut); break;
+		case LVAL_CHAN: lchan_drop(v->chan); break;
 		case LVAL_FUN:
-			if (!v->builtin) {
+			if (v->memo) {
+				lmemo_release(v->memo);
+			} else if (!v->builtin) {
 				lenv_del(v->env);
 				lval_del(v->formals);
 				lval_del(v->body);
+				if (v->orig) {lval_del(v->orig);}
+				if (v->deps) {lval_del(v->deps);}
+				lcode_release(v->code);
 			}
 		break;
 		/* if sexpr or qexpr then delete all elements inside */
@@ -268,18 +759,19 @@ void lval_del(lval* v)
 				lval_del(v->cell[i]);
 			}
 			/* also free the memory allocated to contain the pointers */
-			free(v->cell);
+			lfree(v->cell);
+			if (v->feed && --v->feed->refs == 0) {lfree(v->feed);}
 		break;
 	}
 
 	/* free the memory allocated for the "lval" struct itself */
-	free(v);
+	lfree(v);
 }
 
 lval* lval_add(lval* v, lval* x)
 {
 	v->count++;
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+	v->cell = lrealloc(v->cell, sizeof(lval*) * v->count);
 	v->cell[v->count-1] = x;
 	return v;
 }
@@ -297,7 +789,7 @@ lval* lval_pop(lval* v, int i)
 	v->count--; 
 
 	/* reallocate the memory used */
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+	v->cell = lrealloc(v->cell, sizeof(lval*) * v->count);
 	return x;
 }
 
@@ -330,10 +822,12 @@ void lval_print(lval* v)
 		/* in the case the type is a number print it */
 		/* then 'break' out of the switch */
 		case LVAL_NUM:		printf("%li", v->num); break;
-		case LVAL_ERR:		printf("error: %s", v->err); break;
+		case LVAL_ERR:		printf("error: %s", lerr_msg(v->err)); break;
 		case LVAL_SYM:		printf("%s", v->sym); break;
 		case LVAL_FUN:		
-			if (v->builtin) {
+			if (v->memo) {
+				printf("(memo "); lval_print(v->memo->fun); putchar(')');
+			} else if (v->builtin) {
 				printf("<builtin>");
 			} else {
 				printf("(\\ "); lval_print(v->formals);
@@ -342,6 +836,9 @@ void lval_print(lval* v)
 		break;
 		case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
 		case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+		case LVAL_SEQ: printf("<sequence>"); break;
+		case LVAL_FUT: printf(lfuture_is_actor(v->fut) ? "<actor>" : "<future>"); break;
+		case LVAL_CHAN: printf("<channel>"); break;
 
 	}
 }
@@ -355,6 +852,9 @@ char* ltype_name(int t)
 		case LVAL_SYM: return "Symbol";
 		case LVAL_SEXPR: return "S-Expression";
 		case LVAL_QEXPR: return "Q-Expression";
+		case LVAL_SEQ: return "Sequence";
+		case LVAL_FUT: return "Future";
+		case LVAL_CHAN: return "Channel";
 		default: return "Unknown";
 	}
 }
@@ -373,39 +873,58 @@ lval* lval_join(lval* x, lval* y)
 
 lval* lval_copy(lval* v)
 {
-	lval* x = malloc(sizeof(lval));
+	lval* x = lmalloc(sizeof(lval));
 	x->type = v->type;
 
 	switch (v->type)
 	{
 		/* Copy Funcs and Nums directly */
 		case LVAL_FUN:
-			if (v->builtin) {
+			x->memo = v->memo;
+			x->pins = 0;
+			x->unbound = 0;
+			if (v->memo) {
+				/* Copies share one cache */
+				x->builtin = NULL;
+				v->memo->refs++;
+			} else if (v->builtin) {
 				x->builtin = v->builtin;
+				x->num = v->num;
 			} else {
 				x->builtin = NULL;
 				x->env = lenv_copy(v->env);
 				x->formals = lval_copy(v->formals);
 				x->body = lval_copy(v->body);
+				x->orig = v->orig ? lval_copy(v->orig) : NULL;
+				x->deps = v->deps ? lval_copy(v->deps) : NULL;
+				x->epoch = v->epoch;
+				x->code = v->code;
+				v->code->refs++;
 			}
 			break;
 		case LVAL_NUM: x->num = v->num; break;
+		/* Sequences are immutable so copies share them */
+		case LVAL_SEQ: x->seq = v->seq; v->seq->refs++; break;
+		/* Copies wait for the same evaluation */
+		case LVAL_FUT: x->fut = v->fut; lfuture_hold(v->fut); break;
+		case LVAL_CHAN: x->chan = v->chan; lchan_hold(v->chan); break;
 		/* Copy Strings using malloc & strcpy */
-		case LVAL_ERR:
-				x->err = malloc(strlen(v->err) + 1);
-				strcpy(x->err, v->err); break;
+		case LVAL_ERR: x->err = lerr_copy(v->err); break;
 		case LVAL_SYM:
-				x->sym = malloc(strlen(v->sym) + 1);
+				x->sym = lmalloc(strlen(v->sym) + 1);
 				strcpy(x->sym, v->sym); break;
 		/* Copy Lists by copying each sub-expression */
 		case LVAL_SEXPR:
 		case LVAL_QEXPR:
 				x->count = v->count;
-				x->cell = malloc(sizeof(lval*) * x->count);
+				x->cell = lmalloc(sizeof(lval*) * x->count);
 				for (int i = 0; i < x->count; i++)
 				{
 					x->cell[i] = lval_copy(v->cell[i]);
 				}
+				/* Copies of a body feed back into the same site */
+				x->feed = v->feed;
+				if (v->feed) {v->feed->refs++;}
 		break;
 	}
 	return x;
@@ -414,7 +933,7 @@ lval* lval_copy(lval* v)
 /* Lisp Environment */
 lenv* lenv_new(void)
 {
-	lenv* e = malloc(sizeof(lenv));
+	lenv* e = lmalloc(sizeof(lenv));
 	e->par = NULL;
 	e->count = 0;
 	e->syms = NULL;
@@ -424,29 +943,50 @@ lenv* lenv_new(void)
 
 lenv* lenv_copy(lenv* e) 
 {
-	lenv* n = malloc(sizeof(lenv));
+	lenv* n = lmalloc(sizeof(lenv));
 	n->par = e->par;
 	n->count = e->count;
-	n->syms = malloc(sizeof(char*) * n->count);
-	n->vals = malloc(sizeof(lval*) * n->count);
+	n->syms = lmalloc(sizeof(char*) * n->count);
+	n->vals = lmalloc(sizeof(lval*) * n->count);
 	for (int i = 0; i < e->count; i++)
 	{
-		n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+		n->syms[i] = lmalloc(strlen(e->syms[i]) + 1);
 		strcpy(n->syms[i], e->syms[i]);
 		n->vals[i] = lval_copy(e->vals[i]);
 	}
 	return n;
 }
-void lenv_del(lenv* e)
+/* Drop a value replaced in an environment, unless a call still runs it */
+void lval_unbind(lval* v)
+{
+	if (v->type == LVAL_FUN && v->pins) {
+		v->unbound = 1;
+	} else {
+		lval_del(v);
+	}
+}
+
+void lval_unpin(lval* f)
+{
+	if (--f->pins == 0 && f->unbound) {lval_del(f);}
+}
+
+/* Free the bindings of 'e' but not 'e' itself */
+void lenv_clear(lenv* e)
 {
 	for (int i=0; i < e->count; i++)
 	{
-		free(e->syms[i]);
+		lfree(e->syms[i]);
 		lval_del(e->vals[i]);
 	}
-	free(e->syms);
-	free(e->vals);
-	free(e);
+	lfree(e->syms);
+	lfree(e->vals);
+}
+
+void lenv_del(lenv* e)
+{
+	lenv_clear(e);
+	lfree(e);
 }
 
 lval* lenv_get(lenv* e, lval* k)
@@ -463,19 +1003,45 @@ lval* lenv_get(lenv* e, lval* k)
 	/* If no sym found return error */
 	if (e->par) {
 		return lenv_get(e->par, k);
-	} else {
-		return lval_err("Unbound Symbol '%s'", k->sym);
 	}
+	/* Builtins sit behind the global environment, which can shadow them */
+	lval* b = e == lstate->env ? lbuiltin_find(k->sym) : NULL;
+	if (b) {return lval_copy(b);}
+	return lval_error(LERR_UNBOUND, "Unbound Symbol '%s'", k->sym);
+}
+
+/* Find the value bound to 's' in 'e' only, without copying */
+/* Value bound to 's' in the table of 'e' itself, leaving out the builtins */
+lval* lenv_find(lenv* e, char* s)
+{
+	for (int i=0; i < e->count; i++)
+	{
+		if (strcmp(e->syms[i], s) == 0) {return e->vals[i];}
+	}
+	return NULL;
+}
+
+lval* lenv_peek(lenv* e, char* s)
+{
+	lval* x = lenv_find(e, s);
+	return x || e != lstate->env ? x : lbuiltin_find(s);
+}
+
+lenv* lenv_root(lenv* e)
+{
+	while (e->par) {e = e->par;}
+	return e;
 }
 
 void lenv_put(lenv* e, lval* k, lval* v)
 {
+	if (e == lstate->env) {lstate->env_gen++;}
 	for (int i=0; i < e->count;i++)
 	{
 		/* If variable is found del item at that pos */
 		/* if it does, return a copy of the value */
 		if (strcmp(e->syms[i], k->sym) == 0) {
-			lval_del(e->vals[i]);
+			lval_unbind(e->vals[i]);
 			e->vals[i] = lval_copy(v);
 			return ;
 		}
@@ -483,15 +1049,34 @@ void lenv_put(lenv* e, lval* k, lval* v)
 
 	/* if no existing entry found allocate space for new entry */
 	e->count++;
-	e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-	e->syms = realloc(e->syms, sizeof(char*) * e->count);
+	e->vals = lrealloc(e->vals, sizeof(lval*) * e->count);
+	e->syms = lrealloc(e->syms, sizeof(char*) * e->count);
 
 	/* copy contents of lval and symbol string into new location */
 	e->vals[e->count-1] = lval_copy(v);
-	e->syms[e->count-1] = malloc(strlen(k->sym)+1);
+	e->syms[e->count-1] = lmalloc(strlen(k->sym)+1);
 	strcpy(e->syms[e->count-1], k->sym);
 }
 
+/* Bind 's' to 'v' in 'e', taking ownership of 'v' */
+void lenv_bind(lenv* e, char* s, lval* v)
+{
+	for (int i=0; i < e->count; i++)
+	{
+		if (strcmp(e->syms[i], s) == 0) {
+			lval_unbind(e->vals[i]);
+			e->vals[i] = v;
+			return;
+		}
+	}
+	e->count++;
+	e->vals = lrealloc(e->vals, sizeof(lval*) * e->count);
+	e->syms = lrealloc(e->syms, sizeof(char*) * e->count);
+	e->vals[e->count-1] = v;
+	e->syms[e->count-1] = lmalloc(strlen(s)+1);
+	strcpy(e->syms[e->count-1], s);
+}
+
 void lenv_def(lenv* e, lval* k, lval* v)
 {
 	/* Iterate till e has no parent */
@@ -564,273 +1149,5567 @@ lval* builtin_join(lenv* e, lval* a)
 	return x;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op)
+/* Lazy Sequences */
+lval* lval_seq(int kind, lval* fun, lseq* src)
 {
-	/* ensure all arguments are numbers */
-	for (int i = 0; i < a->count; i++)
-	{
-		LASSERT_TYPE(op, a, i, LVAL_NUM);
-	}
-	/* pop first element */
-	lval* x = lval_pop(a, 0);
-	/* if no arguments and sub then perform unary negation */
-	if ((strcmp(op, "-") == 0) && a->count == 0) {
-		x->num = -x->num;
-	}
+	lseq* s = lmalloc(sizeof(lseq));
+	s->refs = 1;
+	s->kind = kind;
+	s->start = 0;
+	s->end = 0;
+	s->step = 1;
+	s->fun = fun;
+	s->init = NULL;
+	s->src = src;
+	if (src) {src->refs++;}
 
-	/* while elements are still remaining */
-	while (a->count > 0)
+	lval* v = lmalloc(sizeof(lval));
+	v->type = LVAL_SEQ;
+	v->seq = s;
+	return v;
+}
+
+void lseq_release(lseq* s)
+{
+	if (--s->refs) {return;}
+	if (s->fun) {lval_del(s->fun);}
+	if (s->init) {lval_del(s->init);}
+	if (s->src) {lseq_release(s->src);}
+	lfree(s);
+}
+
+lseq_iter* lseq_iter_new(lseq* s)
+{
+	lseq_iter* it = lmalloc(sizeof(lseq_iter));
+	it->s = s;
+	it->i = s->kind == LSEQ_RANGE ? s->start : 0;
+	it->cur = s->init ? lval_copy(s->init) : NULL;
+	it->src = s->src ? lseq_iter_new(s->src) : NULL;
+	return it;
+}
+
+void lseq_iter_del(lseq_iter* it)
+{
+	if (it->cur) {lval_del(it->cur);}
+	if (it->src) {lseq_iter_del(it->src);}
+	lfree(it);
+}
+
+/* Produce the next element, NULL once exhausted, or an error */
+lval* lseq_next(lenv* e, lseq_iter* it)
+{
+	if (--lstate->budget_tick < 0 && lbudget_poll()) {return lbudget_error();}
+	lseq* s = it->s;
+	switch (s->kind)
 	{
-		/* pop the next element */
-		lval* y = lval_pop(a, 0);
+		case LSEQ_RANGE:
+			if (s->step > 0 ? it->i >= s->end : it->i <= s->end) {return NULL;}
+			it->i += s->step;
+			return lval_num(it->i - s->step);
 
-		if (strcmp(op, "+") == 0) {x->num += y->num;}
-		if (strcmp(op, "-") == 0) {x->num -= y->num;}
-		if (strcmp(op, "*") == 0) {x->num *= y->num;}
-		if (strcmp(op, "/") == 0) {
-			/* if  second operand is zero return error */
-			if (y->num == 0) {
-				lval_del(x); lval_del(y);
-				x = lval_err("division by zero!"); 
-				break;
+		case LSEQ_ITERATE: {
+			/* The next value is only computed once it is asked for */
+			if (it->i++) {
+				it->cur = lval_apply(e, s->fun, lval_add(lval_sexpr(), it->cur));
+				if (it->cur->type == LVAL_ERR) {
+					lval* err = it->cur;
+					it->cur = NULL;
+					return err;
+				}
 			}
-			x->num /= y->num;
-		  }
-		lval_del(y);
+			return lval_copy(it->cur);
+		}
+
+		case LSEQ_MAP: {
+			lval* x = lseq_next(e, it->src);
+			if (!x || x->type == LVAL_ERR) {return x;}
+			return lval_apply(e, s->fun, lval_add(lval_sexpr(), x));
+		}
+
+		case LSEQ_FILTER:
+			for (;;)
+			{
+				lval* x = lseq_next(e, it->src);
+				if (!x || x->type == LVAL_ERR) {return x;}
+				lval* r = lval_apply(e, s->fun, lval_add(lval_sexpr(), lval_copy(x)));
+				if (r->type == LVAL_ERR) {lval_del(x); return r;}
+				int keep = r->type != LVAL_NUM || r->num != 0;
+				lval_del(r);
+				if (keep) {return x;}
+				lval_del(x);
+			}
+
+		case LSEQ_TAKE:
+			if (it->i++ >= s->end) {return NULL;}
+			return lseq_next(e, it->src);
 	}
-	
-	lval_del(a); 
-	return x;
+	return NULL;
 }
 
-lval* builtin_var(lenv* e, lval* a, char* func)
+/* Materialize every element of 's' into a Q-Expression */
+lval* lseq_collect(lenv* e, lseq* s)
 {
-	LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
-	lval* syms = a->cell[0];
-	for (int i = 0; i < syms->count; i++)
+	lval* x = lval_qexpr();
+	lseq_iter* it = lseq_iter_new(s);
+	lval* y;
+	while ((y = lseq_next(e, it)))
 	{
-		LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-			"Function '%s' cannot define non-symbol. "
-			"Got %s, Expected %s.", func, 
-			ltype_name(syms->cell[i]->type),
-			ltype_name(LVAL_SYM));
+		if (y->type == LVAL_ERR) {lval_del(x); x = y; break;}
+		x = lval_add(x, y);
 	}
-	LASSERT(a, (syms->count == a->count-1),
-		"Function '%s' passed too many arguments for symbols. "
-		"Got %i, Expected %i.", func, syms->count, a->count-1);
-
+	lseq_iter_del(it);
+	return x;
+}
+
+/* Replace a sequence argument by the list of its elements */
+lval* lval_force(lenv* e, lval* a, int i)
+{
+	if (a->cell[i]->type != LVAL_SEQ) {return a;}
+	lval* x = lseq_collect(e, a->cell[i]->seq);
+	lval_del(a->cell[i]);
+	a->cell[i] = x;
+	return a;
+}
+
+#define LASSERT_LIST(func, args, index) \
+	LASSERT_CODE(args, args->cell[index]->type == LVAL_QEXPR \
+		|| args->cell[index]->type == LVAL_SEQ, LERR_TYPE, \
+		"Function '%s' passed incorrect type for argument %i. " \
+		"Got %s, Expected %s or %s.", func, index, \
+		ltype_name(args->cell[index]->type), \
+		ltype_name(LVAL_QEXPR), ltype_name(LVAL_SEQ))
+
+lval* builtin_len(lenv* e, lval* a)
+{
+	LASSERT_NUM("len", a, 1);
+	LASSERT_LIST("len", a, 0);
+
+	if (a->cell[0]->type == LVAL_QEXPR) {
+		lval* x = lval_num(a->cell[0]->count);
+		lval_del(a);
+		return x;
+	}
+
+	/* Count the elements of a sequence without keeping them */
+	long n = 0;
+	lseq_iter* it = lseq_iter_new(a->cell[0]->seq);
+	lval* y;
+	while ((y = lseq_next(e, it)))
+	{
+		if (y->type == LVAL_ERR) {break;}
+		lval_del(y);
+		n++;
+	}
+	lseq_iter_del(it);
+	lval_del(a);
+	return y ? y : lval_num(n);
+}
+
+lval* builtin_nth(lenv* e, lval* a)
+{
+	LASSERT_NUM("nth", a, 2);
+	LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+	LASSERT_LIST("nth", a, 1);
+	long n = a->cell[0]->num;
+
+	if (a->cell[1]->type == LVAL_SEQ) {
+		LASSERT_CODE(a, n >= 0, LERR_RANGE, "Function 'nth' passed index %li.", n);
+		lseq_iter* it = lseq_iter_new(a->cell[1]->seq);
+		lval* y;
+		for (long i = 0; (y = lseq_next(e, it)); i++)
+		{
+			if (i == n || y->type == LVAL_ERR) {break;}
+			lval_del(y);
+		}
+		lseq_iter_del(it);
+		LASSERT_CODE(a, y != NULL, LERR_RANGE,
+			"Function 'nth' passed index %li past the end of a sequence.", n);
+		lval_del(a);
+		return y;
+	}
+
+	LASSERT_CODE(a, n >= 0 && n < a->cell[1]->count, LERR_RANGE,
+		"Function 'nth' passed index %li for a list of length %i.",
+		n, a->cell[1]->count);
+	return lval_take(lval_take(a, 1), n);
+}
+
+lval* builtin_reverse(lenv* e, lval* a)
+{
+	LASSERT_NUM("reverse", a, 1);
+	LASSERT_LIST("reverse", a, 0);
+	a = lval_force(e, a, 0);
+	if (a->cell[0]->type == LVAL_ERR) {return lval_take(a, 0);}
+
+	lval* x = lval_take(a, 0);
+	for (int i = 0, j = x->count-1; i < j; i++, j--)
+	{
+		lval* t = x->cell[i];
+		x->cell[i] = x->cell[j];
+		x->cell[j] = t;
+	}
+	return x;
+}
+
+lval* builtin_range_of(lenv* e, lval* a, char* func)
+{
+	LASSERT(a, a->count >= 1 && a->count <= 3,
+		"Function '%s' passed incorrect number of arguments. "
+		"Got %i, Expected 1 to 3.", func, a->count);
+	for (int i = 0; i < a->count; i++)
+	{
+		LASSERT_TYPE(func, a, i, LVAL_NUM);
+	}
+
+	/* (range end), (range start end) or (range start end step) */
+	long start = a->count > 1 ? a->cell[0]->num : 0;
+	long end   = a->count > 1 ? a->cell[1]->num : a->cell[0]->num;
+	long step  = a->count > 2 ? a->cell[2]->num : 1;
+	LASSERT(a, step != 0, "Function '%s' passed a step of 0.", func);
+	lval_del(a);
+
+	if (strcmp(func, "lazy-range") == 0) {
+		lval* x = lval_seq(LSEQ_RANGE, NULL, NULL);
+		x->seq->start = start;
+		x->seq->end = end;
+		x->seq->step = step;
+		return x;
+	}
+
+	long n = 0;
+	if (step > 0 && end > start) {n = (end - start + step - 1) / step;}
+	if (step < 0 && end < start) {n = (start - end - step - 1) / -step;}
+
+	/* Each element takes a cell and an lval, and a size for the lval */
+	if (!lmem_fits(n, sizeof(lval*) + sizeof(lval) + sizeof(lmem_head))) {
+		return lval_error(LERR_LIMIT, "memory limit exceeded");
+	}
+
+	/* Size the cell array once rather than growing it per element */
+	lval* x = lval_qexpr();
+	x->cell = lmalloc(sizeof(lval*) * n);
+	for (x->count = 0; x->count < n; x->count++)
+	{
+		x->cell[x->count] = lval_num(start + step * x->count);
+	}
+	return x;
+}
+
+lval* builtin_range(lenv* e, lval* a)
+{
+	return builtin_range_of(e, a, "range");
+}
+
+lval* builtin_lazy_range(lenv* e, lval* a)
+{
+	return builtin_range_of(e, a, "lazy-range");
+}
+
+lval* builtin_iterate(lenv* e, lval* a)
+{
+	LASSERT_NUM("iterate", a, 2);
+	LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
+
+	/* x, (f x), (f (f x)), ... */
+	lval* f = lval_pop(a, 0);
+	lval* x = lval_seq(LSEQ_ITERATE, f, NULL);
+	x->seq->init = lval_take(a, 0);
+	return x;
+}
+
+lval* builtin_take(lenv* e, lval* a)
+{
+	LASSERT_NUM("take", a, 2);
+	LASSERT_TYPE("take", a, 0, LVAL_NUM);
+	LASSERT_LIST("take", a, 1);
+	long n = a->cell[0]->num;
+	LASSERT(a, n >= 0, "Function 'take' passed a negative count %li.", n);
+
+	if (a->cell[1]->type == LVAL_SEQ) {
+		lval* x = lval_seq(LSEQ_TAKE, NULL, a->cell[1]->seq);
+		x->seq->end = n;
+		lval_del(a);
+		return x;
+	}
+
+	lval* x = lval_take(a, 1);
+	while (x->count > n) {lval_del(lval_pop(x, x->count-1));}
+	return x;
+}
+
+lval* builtin_collect(lenv* e, lval* a)
+{
+	LASSERT_NUM("collect", a, 1);
+	LASSERT_LIST("collect", a, 0);
+	return lval_take(lval_force(e, a, 0), 0);
+}
+
+/* Call 'f' with one or two arguments through the non-copying call path */
+lval* lval_call1(lenv* e, lval* f, lval* x)
+{
+	return lval_apply(e, f, lval_add(lval_sexpr(), x));
+}
+
+lval* lval_call2(lenv* e, lval* f, lval* x, lval* y)
+{
+	return lval_apply(e, f, lval_add(lval_add(lval_sexpr(), x), y));
+}
+
+lval* builtin_map(lenv* e, lval* a)
+{
+	LASSERT_NUM("map", a, 2);
+	LASSERT_TYPE("map", a, 0, LVAL_FUN);
+	LASSERT_LIST("map", a, 1);
+
+	/* Mapping a sequence gives another sequence */
+	if (a->cell[1]->type == LVAL_SEQ) {
+		lval* f = lval_pop(a, 0);
+		lval* x = lval_seq(LSEQ_MAP, f, a->cell[0]->seq);
+		lval_del(a);
+		return x;
+	}
+
+	/* Replace every element by its result, reusing the list */
+	lval* f = a->cell[0];
+	lval* l = a->cell[1];
+	for (int i = 0; i < l->count; i++)
+	{
+		l->cell[i] = lval_call1(e, f, l->cell[i]);
+		if (l->cell[i]->type == LVAL_ERR) {
+			return lval_take(lval_take(a, 1), i);
+		}
+	}
+	return lval_take(a, 1);
+}
+
+lval* builtin_filter(lenv* e, lval* a)
+{
+	LASSERT_NUM("filter", a, 2);
+	LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+	LASSERT_LIST("filter", a, 1);
+
+	if (a->cell[1]->type == LVAL_SEQ) {
+		lval* f = lval_pop(a, 0);
+		lval* x = lval_seq(LSEQ_FILTER, f, a->cell[0]->seq);
+		lval_del(a);
+		return x;
+	}
+
+	/* Compact the kept elements towards the front of the list */
+	lval* f = a->cell[0];
+	lval* l = a->cell[1];
+	int kept = 0;
+	for (int i = 0; i < l->count; i++)
+	{
+		lval* r = lval_call1(e, f, lval_copy(l->cell[i]));
+		if (r->type == LVAL_ERR) {
+			/* Release what was kept and what is still unvisited */
+			for (int j = 0; j < kept; j++) {lval_del(l->cell[j]);}
+			for (int j = i; j < l->count; j++) {lval_del(l->cell[j]);}
+			l->count = 0;
+			lval_del(a);
+			return r;
+		}
+		int keep = r->type != LVAL_NUM || r->num != 0;
+		lval_del(r);
+		if (keep) {
+			l->cell[kept++] = l->cell[i];
+		} else {
+			lval_del(l->cell[i]);
+		}
+	}
+	l->count = kept;
+	return lval_take(a, 1);
+}
+
+lval* builtin_fold(lenv* e, lval* a, char* func)
+{
+	LASSERT_NUM(func, a, 3);
+	LASSERT_TYPE(func, a, 0, LVAL_FUN);
+	LASSERT_LIST(func, a, 2);
+
+	lval* f = a->cell[0];
+	int left = strcmp(func, "foldl") == 0;
+
+	/* A left fold consumes a sequence one element at a time */
+	if (left && a->cell[2]->type == LVAL_SEQ) {
+		lval* acc = a->cell[1];
+		lseq_iter* it = lseq_iter_new(a->cell[2]->seq);
+		lval* y;
+		while (acc->type != LVAL_ERR && (y = lseq_next(e, it)))
+		{
+			if (y->type == LVAL_ERR) {lval_del(acc); acc = y; break;}
+			acc = lval_call2(e, f, acc, y);
+		}
+		lseq_iter_del(it);
+		a->cell[1] = lval_sexpr();
+		lval_del(a);
+		return acc;
+	}
+
+	/* A right fold needs the last element first */
+	a = lval_force(e, a, 2);
+	if (a->cell[2]->type == LVAL_ERR) {return lval_take(a, 2);}
+	lval* acc = a->cell[1];
+	lval* l = a->cell[2];
+
+	/* Elements are moved into each call, leaving the list empty */
+	for (int k = 0; k < l->count; k++)
+	{
+		int i = left ? k : l->count-1-k;
+		acc = left ? lval_call2(e, f, acc, l->cell[i])
+		           : lval_call2(e, f, l->cell[i], acc);
+		l->cell[i] = NULL;
+		if (acc->type == LVAL_ERR) {break;}
+	}
+	for (int i = 0; i < l->count; i++)
+	{
+		if (l->cell[i]) {lval_del(l->cell[i]);}
+	}
+	l->count = 0;
+	a->cell[1] = lval_sexpr();
+	lval_del(a);
+	return acc;
+}
+
+lval* builtin_foldl(lenv* e, lval* a)
+{
+	return builtin_fold(e, a, "foldl");
+}
+
+lval* builtin_foldr(lenv* e, lval* a)
+{
+	return builtin_fold(e, a, "foldr");
+}
+
+lval* builtin_op(lenv* e, lval* a, char* op)
+{
+	/* ensure all arguments are numbers */
+	for (int i = 0; i < a->count; i++)
+	{
+		LASSERT_TYPE(op, a, i, LVAL_NUM);
+	}
+	/* pop first element */
+	lval* x = lval_pop(a, 0);
+	/* if no arguments and sub then perform unary negation */
+	if ((strcmp(op, "-") == 0) && a->count == 0) {
+		x->num = -x->num;
+	}
+
+	/* while elements are still remaining */
+	while (a->count > 0)
+	{
+		/* pop the next element */
+		lval* y = lval_pop(a, 0);
+
+		if (strcmp(op, "+") == 0) {x->num += y->num;}
+		if (strcmp(op, "-") == 0) {x->num -= y->num;}
+		if (strcmp(op, "*") == 0) {x->num *= y->num;}
+		if (strcmp(op, "/") == 0) {
+			/* if  second operand is zero return error */
+			if (y->num == 0) {
+				lval_del(x); lval_del(y);
+				x = lval_error(LERR_DIV_ZERO, "division by zero!");
+				break;
+			}
+			x->num /= y->num;
+		  }
+		lval_del(y);
+	}
+	
+	lval_del(a); 
+	return x;
+}
+
+lval* builtin_var(lenv* e, lval* a, char* func)
+{
+	LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+	lval* syms = a->cell[0];
+	for (int i = 0; i < syms->count; i++)
+	{
+		LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+			"Function '%s' cannot define non-symbol. "
+			"Got %s, Expected %s.", func, 
+			ltype_name(syms->cell[i]->type),
+			ltype_name(LVAL_SYM));
+	}
+	LASSERT(a, (syms->count == a->count-1),
+		"Function '%s' passed too many arguments for symbols. "
+		"Got %i, Expected %i.", func, syms->count, a->count-1);
+
+	/* Replacing a global invalidates functions optimized against it */
+	lenv* t = (strcmp(func, "def") == 0) ? lenv_root(e) : e;
+	int rebound = 0;
+	for (int i=0; i < syms->count; i++)
+	{
+		if (!t->par && lenv_peek(t, syms->cell[i]->sym)) {rebound = 1;}
+	}
+
 	for (int i=0; i < syms->count; i++)
 	{
 		/* If 'def' define in globally. If 'put' define in locally */
 		if (strcmp(func, "def") == 0) {
+			lval_fun_optimize(e, a->cell[i+1]);
 			lenv_def(e, syms->cell[i], a->cell[i+1]);
 		}
 		if (strcmp(func, "=") == 0) {
 			lenv_put(e, syms->cell[i], a->cell[i+1]);
 		}
 	}
+
+	if (rebound) {
+		lstate->def_epoch++;
+		lenv_deopt(t, syms);
+	}
+	lval_del(a);
+	return lval_sexpr();
+}
+
+lval* builtin_ord(lenv* e, lval* a, char* op)
+{
+	LASSERT_NUM(op, a, 2);
+	LASSERT_TYPE(op, a, 0, LVAL_NUM);
+	LASSERT_TYPE(op, a, 1, LVAL_NUM);
+
+	int r = 0;
+	if (strcmp(op, ">") == 0)  {r = (a->cell[0]->num >  a->cell[1]->num);}
+	if (strcmp(op, "<") == 0)  {r = (a->cell[0]->num <  a->cell[1]->num);}
+	if (strcmp(op, ">=") == 0) {r = (a->cell[0]->num >= a->cell[1]->num);}
+	if (strcmp(op, "<=") == 0) {r = (a->cell[0]->num <= a->cell[1]->num);}
+	lval_del(a);
+	return lval_num(r);
+}
+
+int lval_eq(lval* x, lval* y)
+{
+	/* Different types are always unequal */
+	if (x->type != y->type) {return 0;}
+
+	switch (x->type)
+	{
+		case LVAL_NUM: return (x->num == y->num);
+		case LVAL_ERR:
+			return x->err->code == y->err->code
+				&& strcmp(lerr_msg(x->err), lerr_msg(y->err)) == 0;
+		case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
+		case LVAL_SEQ: return x->seq == y->seq;
+		case LVAL_FUT: return x->fut == y->fut;
+		case LVAL_CHAN: return x->chan == y->chan;
+		/* If builtin compare pointers, otherwise formals, body and bound arguments */
+		case LVAL_FUN:
+			if (x->memo || y->memo) {
+				return x->memo == y->memo;
+			}
+			if (x->builtin || y->builtin) {
+				return x->builtin == y->builtin && x->num == y->num;
+			}
+			if (!lval_eq(x->formals, y->formals) || !lval_eq(x->body, y->body)
+				|| x->env->count != y->env->count) {
+				return 0;
+			}
+			for (int i = 0; i < x->env->count; i++)
+			{
+				if (strcmp(x->env->syms[i], y->env->syms[i]) != 0
+					|| !lval_eq(x->env->vals[i], y->env->vals[i])) {
+					return 0;
+				}
+			}
+			return 1;
+		/* If list compare every individual element */
+		case LVAL_QEXPR:
+		case LVAL_SEXPR:
+			if (x->count != y->count) {return 0;}
+			for (int i = 0; i < x->count; i++)
+			{
+				if (!lval_eq(x->cell[i], y->cell[i])) {return 0;}
+			}
+			return 1;
+	}
+	return 0;
+}
+
+lval* builtin_cmp(lenv* e, lval* a, char* op)
+{
+	LASSERT_NUM(op, a, 2);
+	int r = 0;
+	if (strcmp(op, "==") == 0) {r =  lval_eq(a->cell[0], a->cell[1]);}
+	if (strcmp(op, "!=") == 0) {r = !lval_eq(a->cell[0], a->cell[1]);}
+	lval_del(a);
+	return lval_num(r);
+}
+
+lval* builtin_if(lenv* e, lval* a)
+{
+	LASSERT_NUM("if", a, 3);
+	LASSERT_TYPE("if", a, 0, LVAL_NUM);
+	LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+	LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+	/* Mark both expressions as evaluable */
+	a->cell[1]->type = LVAL_SEXPR;
+	a->cell[2]->type = LVAL_SEXPR;
+
+	/* If condition is true evaluate first expression, otherwise second */
+	lval* x = lval_eval(e, lval_pop(a, a->cell[0]->num ? 1 : 2));
+	lval_del(a);
+	return x;
+}
+
+/* Raise an error whose message is the contents of a Q-Expression */
+lval* builtin_error(lenv* e, lval* a)
+{
+	LASSERT_NUM("error", a, 1);
+	LASSERT_TYPE("error", a, 0, LVAL_QEXPR);
+	lval* q = a->cell[0];
+	for (int i = 0; i < q->count; i++)
+	{
+		LASSERT_CODE(a, q->cell[i]->type == LVAL_SYM || q->cell[i]->type == LVAL_NUM,
+			LERR_TYPE, "Function 'error' passed a message with a %s.",
+			ltype_name(q->cell[i]->type));
+	}
+
+	/* Join the words with spaces */
+	size_t len = 1;
+	for (int i = 0; i < q->count; i++)
+	{
+		len += (q->cell[i]->type == LVAL_SYM ? strlen(q->cell[i]->sym) : 21) + 1;
+	}
+	char* msg = lmalloc(len);
+	char* out = msg;
+	*out = '\0';
+	for (int i = 0; i < q->count; i++)
+	{
+		if (i) {*out++ = ' ';}
+		if (q->cell[i]->type == LVAL_SYM) {
+			out += sprintf(out, "%s", q->cell[i]->sym);
+		} else {
+			out += sprintf(out, "%li", q->cell[i]->num);
+		}
+	}
+	lval* x = lval_error(LERR_USER, "%s", msg);
+	lfree(msg);
+	lval_del(a);
+	return x;
+}
+
+/*
+ * Evaluate a Q-Expression, and if it fails call the handler with
+ * {code message}. Errors are values, and each frame hands one up as soon
+ * as an operand fails, so reaching the nearest 'try' costs O(1) a frame.
+ */
+lval* builtin_try(lenv* e, lval* a)
+{
+	LASSERT_NUM("try", a, 2);
+	LASSERT_TYPE("try", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("try", a, 1, LVAL_FUN);
+
+	lval* body = lval_pop(a, 0);
+	body->type = LVAL_SEXPR;
+	lval* x = lval_eval(e, body);
+	if (x->type != LVAL_ERR) {
+		lval_del(a);
+		return x;
+	}
+
+	lval* info = lval_qexpr();
+	lval_add(info, lval_num(x->err->code));
+	lval_add(info, lval_sym(lerr_msg(x->err)));
+	lval_del(x);
+	x = lval_call1(e, a->cell[0], info);
+	lval_del(a);
+	return x;
+}
+
+/* Set the steps and milliseconds each following top-level evaluation gets */
+lval* builtin_budget(lenv* e, lval* a)
+{
+	LASSERT_NUM("budget", a, 2);
+	LASSERT_TYPE("budget", a, 0, LVAL_NUM);
+	LASSERT_TYPE("budget", a, 1, LVAL_NUM);
+	LASSERT_CODE(a, a->cell[0]->num >= 0 && a->cell[1]->num >= 0, LERR_RANGE,
+		"Function 'budget' passed a negative limit.");
+
+	lstate->budget_fuel = a->cell[0]->num;
+	lstate->budget_ms = a->cell[1]->num;
+	lval_del(a);
+	return lval_sexpr();
+}
+
+/*
+ * Bytes in use and the most ever in use, as {current peak}. A call needs
+ * an operand, so it takes an ignored one: (mem-usage ())
+ */
+lval* builtin_mem_usage(lenv* e, lval* a)
+{
+	LASSERT(a, a->count <= 1,
+		"Function 'mem-usage' passed incorrect number of arguments. "
+		"Got %i, Expected 0 or 1.", a->count);
+	lval_del(a);
+	lval* x = lval_qexpr();
+	lval_add(x, lval_num(lstate->mem_used));
+	lval_add(x, lval_num(lstate->mem_peak));
+	return x;
+}
+
+lval* builtin_gt(lenv* e, lval* a) {return builtin_ord(e, a, ">");}
+lval* builtin_lt(lenv* e, lval* a) {return builtin_ord(e, a, "<");}
+lval* builtin_ge(lenv* e, lval* a) {return builtin_ord(e, a, ">=");}
+lval* builtin_le(lenv* e, lval* a) {return builtin_ord(e, a, "<=");}
+lval* builtin_eq(lenv* e, lval* a) {return builtin_cmp(e, a, "==");}
+lval* builtin_ne(lenv* e, lval* a) {return builtin_cmp(e, a, "!=");}
+
+lval* builtin_add(lenv* e, lval* a)
+{
+	return builtin_op(e, a, "+");
+}
+
+lval* builtin_sub(lenv* e, lval* a)
+{
+	return builtin_op(e, a, "-");
+}
+
+lval* builtin_mul(lenv* e, lval* a)
+{
+	return builtin_op(e, a, "*");
+}
+
+lval* builtin_div(lenv* e, lval* a)
+{
+	return builtin_op(e, a, "/");
+}
+
+lval* builtin_def(lenv* e, lval* a)
+{
+	return builtin_var(e, a, "def");
+}
+
+lval* builtin_put(lenv* e, lval* a)
+{
+	return builtin_var(e, a, "=");
+}
+
+/* Hash of 's' with multiplier 'm', as gen-builtins.awk computes it */
+uint32_t lbuiltin_hash(const char* s, uint32_t m)
+{
+	uint32_t h = m;
+	for (; *s; s++) {h = h * m + (unsigned char)*s;}
+	return h;
+}
+
+/* The builtin named 's', found through the perfect hash of builtins.h */
+lval* lbuiltin_find(char* s)
+{
+	uint32_t b = lbuiltin_hash(s, 31) % LBUILTIN_BUCKETS;
+	uint32_t i = lbuiltin_hash(s, 2 * lbuiltin_disp[b] + 33) % LBUILTIN_SLOTS;
+	const lbuiltin_def* d = &lbuiltin_table[i];
+	if (!d->name || strcmp(d->name, s) != 0) {return NULL;}
+
+	/* Each interpreter fills in its values on first use */
+	lval* v = &lstate->builtins[d->id];
+	if (!v->builtin) {
+		v->type = LVAL_FUN;
+		v->builtin = d->fn;
+	}
+	return v;
+}
+
+/* Memoization */
+/* FNV-1a over the structure of 'v', so equal values hash equally */
+unsigned long lval_hash_bytes(unsigned long h, void* p, size_t n)
+{
+	unsigned char* b = p;
+	for (size_t i = 0; i < n; i++)
+	{
+		h ^= b[i];
+		h *= 1099511628211UL;
+	}
+	return h;
+}
+
+unsigned long lval_hash_into(unsigned long h, lval* v)
+{
+	h = lval_hash_bytes(h, &v->type, sizeof(v->type));
+	switch (v->type)
+	{
+		case LVAL_NUM: return lval_hash_bytes(h, &v->num, sizeof(v->num));
+		case LVAL_ERR: {
+			char* msg = lerr_msg(v->err);
+			return lval_hash_bytes(h, msg, strlen(msg));
+		}
+		case LVAL_SYM: return lval_hash_bytes(h, v->sym, strlen(v->sym));
+		case LVAL_SEQ: return lval_hash_bytes(h, &v->seq, sizeof(v->seq));
+		case LVAL_FUT: return lval_hash_bytes(h, &v->fut, sizeof(v->fut));
+		case LVAL_CHAN: return lval_hash_bytes(h, &v->chan, sizeof(v->chan));
+		case LVAL_FUN:
+			if (v->memo) {return lval_hash_bytes(h, &v->memo, sizeof(v->memo));}
+			if (v->builtin) {
+				h = lval_hash_bytes(h, &v->num, sizeof(v->num));
+				return lval_hash_bytes(h, &v->builtin, sizeof(v->builtin));
+			}
+			h = lval_hash_into(lval_hash_into(h, v->formals), v->body);
+			/* A partial application differs by the arguments bound so far */
+			for (int i = 0; i < v->env->count; i++)
+			{
+				h = lval_hash_bytes(h, v->env->syms[i], strlen(v->env->syms[i]));
+				h = lval_hash_into(h, v->env->vals[i]);
+			}
+			return h;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			h = lval_hash_bytes(h, &v->count, sizeof(v->count));
+			for (int i = 0; i < v->count; i++) {h = lval_hash_into(h, v->cell[i]);}
+			return h;
+	}
+	return h;
+}
+
+unsigned long lval_hash(lval* v)
+{
+	return lval_hash_into(14695981039346656037UL, v);
+}
+
+/* Entries a memo cache can hold at most */
+#define LMEMO_MAX (1L << 24)
+
+lval* lval_memo(lval* f, long cap)
+{
+	lmemo* m = lmalloc(sizeof(lmemo));
+	m->refs = 1;
+	m->fun = f;
+	m->cap = cap;
+	m->count = 0;
+	/* Power of two buckets, at least one per entry */
+	m->nbuckets = 1;
+	while (m->nbuckets < cap && m->nbuckets < LMEMO_MAX) {m->nbuckets *= 2;}
+	m->buckets = lcalloc(m->nbuckets, sizeof(lmemo_entry*));
+	m->newest = NULL;
+	m->oldest = NULL;
+	m->hits = 0;
+	m->misses = 0;
+
+	lval* v = lmalloc(sizeof(lval));
+	v->type = LVAL_FUN;
+	v->builtin = NULL;
+	v->memo = m;
+	v->pins = 0;
+	v->unbound = 0;
+	return v;
+}
+
+void lmemo_unlink(lmemo* m, lmemo_entry* x)
+{
+	if (x->newer) {x->newer->older = x->older;} else {m->newest = x->older;}
+	if (x->older) {x->older->newer = x->newer;} else {m->oldest = x->newer;}
+}
+
+void lmemo_push(lmemo* m, lmemo_entry* x)
+{
+	x->newer = NULL;
+	x->older = m->newest;
+	if (m->newest) {m->newest->newer = x;} else {m->oldest = x;}
+	m->newest = x;
+}
+
+void lmemo_evict(lmemo* m)
+{
+	lmemo_entry* x = m->oldest;
+	lmemo_unlink(m, x);
+	lmemo_entry** p = &m->buckets[x->hash & (m->nbuckets-1)];
+	while (*p != x) {p = &(*p)->chain;}
+	*p = x->chain;
+	lval_del(x->args);
+	lval_del(x->val);
+	lfree(x);
+	m->count--;
+}
+
+void lmemo_release(lmemo* m)
+{
+	if (--m->refs) {return;}
+	while (m->count) {lmemo_evict(m);}
+	lfree(m->buckets);
+	lval_del(m->fun);
+	lfree(m);
+}
+
+lval* lmemo_call(lenv* e, lmemo* m, lval* a)
+{
+	unsigned long h = lval_hash(a);
+	lmemo_entry** b = &m->buckets[h & (m->nbuckets-1)];
+	for (lmemo_entry* x = *b; x; x = x->chain)
+	{
+		if (x->hash == h && lval_eq(x->args, a)) {
+			m->hits++;
+			lmemo_unlink(m, x);
+			lmemo_push(m, x);
+			lval_del(a);
+			return lval_copy(x->val);
+		}
+	}
+
+	m->misses++;
+	lval* args = lval_copy(a);
+	lval* r = lval_apply(e, m->fun, a);
+	/* Errors are not results, leave them to be raised again */
+	if (r->type == LVAL_ERR) {lval_del(args); return r;}
+
+	if (m->count == m->cap) {lmemo_evict(m);}
+	lmemo_entry* x = lmalloc(sizeof(lmemo_entry));
+	x->hash = h;
+	x->args = args;
+	x->val = lval_copy(r);
+	/* Bucket may have changed while evaluating */
+	b = &m->buckets[h & (m->nbuckets-1)];
+	x->chain = *b;
+	*b = x;
+	lmemo_push(m, x);
+	m->count++;
+	return r;
+}
+
+lval* builtin_memo(lenv* e, lval* a)
+{
+	LASSERT(a, a->count == 1 || a->count == 2,
+		"Function 'memo' passed incorrect number of arguments. "
+		"Got %i, Expected 1 or 2.", a->count);
+	LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+	long cap = 1024;
+	if (a->count == 2) {
+		LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+		LASSERT(a, a->cell[1]->num > 0,
+			"Function 'memo' passed a non-positive cache size.");
+		cap = a->cell[1]->num;
+		LASSERT_CODE(a, cap <= LMEMO_MAX, LERR_RANGE,
+			"Function 'memo' passed size %li, Expected at most %li.", cap, LMEMO_MAX);
+	}
+	/* Its buckets, of which there are fewer than twice the entries */
+	if (!lmem_fits(cap, 2 * sizeof(lmemo_entry*))) {
+		lval_del(a);
+		return lval_error(LERR_LIMIT, "memory limit exceeded");
+	}
+	return lval_memo(lval_take(a, 0), cap);
+}
+
+lval* builtin_memo_stats(lenv* e, lval* a)
+{
+	LASSERT_NUM("memo-stats", a, 1);
+	LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN);
+	LASSERT(a, a->cell[0]->memo != NULL,
+		"Function 'memo-stats' passed a function that is not memoized.");
+
+	/* {hits misses size capacity} */
+	lmemo* m = a->cell[0]->memo;
+	lval* x = lval_qexpr();
+	lval_add(x, lval_num(m->hits));
+	lval_add(x, lval_num(m->misses));
+	lval_add(x, lval_num(m->count));
+	lval_add(x, lval_num(m->cap));
+	lval_del(a);
+	return x;
+}
+
+/* Optimizer */
+/*
+ * Lambda bodies are rewritten once when the function is created instead of
+ * being re-evaluated verbatim on every call:
+ *   - calls to pure builtins whose arguments are all constants are folded,
+ *   - constants bound with '=' are propagated into the rest of the body,
+ *   - 'if' with a constant condition is replaced by the branch it takes,
+ *   - calls to small, pure, non-recursive lambdas are replaced by their body.
+ * Globals are resolved when the function is defined. Each function records
+ * the globals its rewrite relied on, and replacing any global binding bumps
+ * 'def_epoch' so that stale functions are rebuilt from their original body.
+ */
+struct lopt;
+typedef struct lopt lopt;
+struct lopt
+{
+	lenv* e;
+	/* Symbols the body may rebind locally; these are never folded */
+	lval* shadow;
+	/* Set if the body can rebind anything (eval, computed '=') */
+	int opaque;
+	/* Constants bound with '=' that are still live */
+	lenv* consts;
+	/* Globals the rewritten body depends on */
+	lval* deps;
+};
+
+int lbuiltin_pure(lbuiltin f)
+{
+	return f == builtin_add || f == builtin_sub
+		|| f == builtin_mul || f == builtin_div
+		|| f == builtin_gt  || f == builtin_lt
+		|| f == builtin_ge  || f == builtin_le
+		|| f == builtin_eq  || f == builtin_ne
+		|| f == builtin_list || f == builtin_head
+		|| f == builtin_tail || f == builtin_join
+		|| f == builtin_len  || f == builtin_nth
+		|| f == builtin_reverse;
+}
+
+int lval_is_const(lval* v)
+{
+	return v->type == LVAL_NUM || v->type == LVAL_QEXPR;
+}
+
+int lval_has_sym(lval* q, char* s)
+{
+	for (int i = 0; i < q->count; i++)
+	{
+		if (q->cell[i]->type == LVAL_SYM && strcmp(q->cell[i]->sym, s) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Global value of symbol 'v' as seen when the body was defined */
+lval* lval_opt_global(lopt* o, lval* v)
+{
+	if (v->type != LVAL_SYM) {return NULL;}
+	lval* x = lenv_peek(lenv_root(o->e), v->sym);
+	return (x && x->type == LVAL_FUN) ? x : NULL;
+}
+
+/* Function called by head 'v', or NULL if the body may rebind it */
+lval* lval_opt_callee(lopt* o, lval* v)
+{
+	if (v->type != LVAL_SYM || lval_has_sym(o->shadow, v->sym)) {return NULL;}
+	return lval_opt_global(o, v);
+}
+
+/* Collect every symbol the body binds with '=' or 'def' */
+void lval_opt_scan(lopt* o, lval* v)
+{
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {return;}
+	if (v->count) {
+		lval* f = lval_opt_global(o, v->cell[0]);
+		if (f && f->builtin == builtin_eval) {o->opaque = 1;}
+		if (f && (f->builtin == builtin_put || f->builtin == builtin_def)) {
+			if (v->count < 2 || v->cell[1]->type != LVAL_QEXPR) {
+				o->opaque = 1;
+			} else {
+				for (int i = 0; i < v->cell[1]->count; i++)
+				{
+					lval_add(o->shadow, lval_copy(v->cell[1]->cell[i]));
+				}
+			}
+		}
+	}
+	for (int i = 0; i < v->count; i++) {lval_opt_scan(o, v->cell[i]);}
+}
+
+void lval_opt_depend(lopt* o, char* s)
+{
+	if (!lval_has_sym(o->deps, s)) {lval_add(o->deps, lval_sym(s));}
+}
+
+void lval_opt_forget(lopt* o)
+{
+	lenv_del(o->consts);
+	o->consts = lenv_new();
+}
+
+/* Keep only the constants bound to the same value in both 'x' and 'y' */
+lenv* lenv_intersect(lenv* x, lenv* y)
+{
+	lenv* n = lenv_new();
+	for (int i = 0; i < x->count; i++)
+	{
+		lval* v = lenv_peek(y, x->syms[i]);
+		if (v && lval_eq(v, x->vals[i])) {
+			lval* k = lval_sym(x->syms[i]);
+			lenv_put(n, k, v);
+			lval_del(k);
+		}
+	}
+	return n;
+}
+
+lval* lval_opt(lopt* o, lval* v);
+
+/* Optimize a Q-Expression that will be evaluated as code */
+lval* lval_opt_code(lopt* o, lval* q)
+{
+	q->type = LVAL_SEXPR;
+	q = lval_opt(o, q);
+	if (q->type == LVAL_SEXPR) {
+		q->type = LVAL_QEXPR;
+		return q;
+	}
+	/* Folded to a single value, keep it evaluable */
+	return lval_add(lval_qexpr(), q);
+}
+
+lval* lval_opt_if(lopt* o, lval* v)
+{
+	v->cell[1] = lval_opt(o, v->cell[1]);
+	if (v->cell[2]->type != LVAL_QEXPR || v->cell[3]->type != LVAL_QEXPR) {
+		return v;
+	}
+
+	/* Condition is known so only the branch taken survives */
+	if (v->cell[1]->type == LVAL_NUM) {
+		lval_opt_depend(o, v->cell[0]->sym);
+		lval* b = lval_pop(v, v->cell[1]->num ? 2 : 3);
+		lval_del(v);
+		b->type = LVAL_SEXPR;
+		return lval_opt(o, b);
+	}
+
+	/* Either branch may run, so only agreeing constants stay live */
+	lenv* other = lenv_copy(o->consts);
+	v->cell[2] = lval_opt_code(o, v->cell[2]);
+	lenv* taken = o->consts;
+	o->consts = other;
+	v->cell[3] = lval_opt_code(o, v->cell[3]);
+	other = o->consts;
+	o->consts = lenv_intersect(taken, other);
+	lenv_del(taken); lenv_del(other);
+	return v;
+}
+
+/* Record the constants bound by a call to '=' */
+void lval_opt_bind(lopt* o, lval* v)
+{
+	lval* syms = v->cell[1];
+	if (syms->count != v->count-2) {lval_opt_forget(o); return;}
+	for (int i = 0; i < syms->count; i++)
+	{
+		if (syms->cell[i]->type != LVAL_SYM) {lval_opt_forget(o); return;}
+	}
+
+	for (int i = 0; i < syms->count; i++)
+	{
+		lval* x = v->cell[i+2];
+		if (lval_is_const(x)) {
+			lenv_put(o->consts, syms->cell[i], x);
+			continue;
+		}
+		/* Rebound to an unknown value, drop the constant */
+		lenv* rest = lenv_new();
+		for (int j = 0; j < o->consts->count; j++)
+		{
+			if (strcmp(o->consts->syms[j], syms->cell[i]->sym) == 0) {continue;}
+			lval* k = lval_sym(o->consts->syms[j]);
+			lenv_put(rest, k, o->consts->vals[j]);
+			lval_del(k);
+		}
+		lenv_del(o->consts);
+		o->consts = rest;
+	}
+}
+
+int lval_size(lval* v)
+{
+	int n = 1;
+	if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+		for (int i = 0; i < v->count; i++) {n += lval_size(v->cell[i]);}
+	}
+	return n;
+}
+
+/* Is 'v' a call to 'if' whose branches are evaluated as code */
+int lval_opt_is_if(lopt* o, lval* v)
+{
+	lval* g = v->count == 4 ? lval_opt_callee(o, v->cell[0]) : NULL;
+	return g && g->builtin == builtin_if;
+}
+
+/* Check expression 'v' only calls builtins without side effects */
+int lval_opt_pure(lopt* o, lval* formals, lval* v)
+{
+	if (v->type == LVAL_SYM) {return 1;}
+	if (v->type != LVAL_SEXPR) {return v->type != LVAL_ERR;}
+	if (v->count == 0) {return 1;}
+	if (v->cell[0]->type != LVAL_SYM) {return 0;}
+	if (lval_has_sym(formals, v->cell[0]->sym)) {return 0;}
+
+	int branch = lval_opt_is_if(o, v);
+	lval* g = lval_opt_callee(o, v->cell[0]);
+	if (!branch && !(g && lbuiltin_pure(g->builtin))) {return 0;}
+
+	for (int i = 1; i < v->count; i++)
+	{
+		lval* x = v->cell[i];
+		int code = branch && i >= 2 && x->type == LVAL_QEXPR;
+		if (code) {x->type = LVAL_SEXPR;}
+		int ok = lval_opt_pure(o, formals, x);
+		if (code) {x->type = LVAL_QEXPR;}
+		if (!ok) {return 0;}
+	}
+	return 1;
+}
+
+/* Count the uses of 's', and those that are not inside an 'if' branch */
+void lval_opt_uses(lopt* o, lval* v, char* s, int branch, int* all, int* always)
+{
+	if (v->type == LVAL_SYM && strcmp(v->sym, s) == 0) {
+		(*all)++;
+		if (!branch) {(*always)++;}
+	}
+	if (v->type != LVAL_SEXPR) {return;}
+	int cond = lval_opt_is_if(o, v);
+	for (int i = 0; i < v->count; i++)
+	{
+		int code = cond && i >= 2 && v->cell[i]->type == LVAL_QEXPR;
+		if (code) {v->cell[i]->type = LVAL_SEXPR;}
+		lval_opt_uses(o, v->cell[i], s, branch || code, all, always);
+		if (code) {v->cell[i]->type = LVAL_QEXPR;}
+	}
+}
+
+/* Replace every formal in 'v' by its argument, all at once */
+lval* lval_opt_subst(lopt* o, lval* v, lval* formals, lval* args)
+{
+	if (v->type == LVAL_SYM) {
+		for (int i = 0; i < formals->count; i++)
+		{
+			if (strcmp(v->sym, formals->cell[i]->sym) == 0) {
+				lval_del(v);
+				return lval_copy(args->cell[i+1]);
+			}
+		}
+		return v;
+	}
+	if (v->type != LVAL_SEXPR) {return v;}
+	int cond = lval_opt_is_if(o, v);
+	for (int i = 0; i < v->count; i++)
+	{
+		int code = cond && i >= 2 && v->cell[i]->type == LVAL_QEXPR;
+		if (code) {v->cell[i]->type = LVAL_SEXPR;}
+		v->cell[i] = lval_opt_subst(o, v->cell[i], formals, args);
+		if (code) {v->cell[i]->type = LVAL_QEXPR;}
+	}
+	return v;
+}
+
+/* Splice the body of lambda 'g' into call 'v' when that is safe */
+lval* lval_opt_inline(lopt* o, lval* v, lval* g)
+{
+	char* name = v->cell[0]->sym;
+	if (g->formals->count != v->count-1 || g->env->count) {return v;}
+	if (lval_size(g->body) > lstate->opt_inline_size) {return v;}
+
+	/* Body must only call pure builtins and never name itself */
+	lval* body = lval_copy(g->body);
+	body->type = LVAL_SEXPR;
+	int all = 0, always = 0;
+	lval_opt_uses(o, body, name, 0, &all, &always);
+	if (all || !lval_opt_pure(o, g->formals, body)) {
+		lval_del(body);
+		return v;
+	}
+
+	/*
+	 * Arguments are evaluated exactly once before the call. Keep that by
+	 * requiring each one to be used outside of any branch, and anything
+	 * but a constant or symbol to be pure and used only once.
+	 */
+	for (int i = 0; i < g->formals->count; i++)
+	{
+		lval* x = v->cell[i+1];
+		all = 0; always = 0;
+		lval_opt_uses(o, body, g->formals->cell[i]->sym, 0, &all, &always);
+		int ok = lval_is_const(x)
+			|| (x->type == LVAL_SYM && always)
+			|| (all == 1 && always == 1 && lval_opt_pure(o, o->shadow, x));
+		if (!ok) {lval_del(body); return v;}
+	}
+
+	lval_opt_depend(o, name);
+	if (g->deps) {
+		for (int i = 0; i < g->deps->count; i++)
+		{
+			lval_opt_depend(o, g->deps->cell[i]->sym);
+		}
+	}
+	body = lval_opt_subst(o, body, g->formals, v);
+	lval_del(v);
+	return lval_opt(o, body);
+}
+
+/* Combine the constant operands of '+' and '*', as in (* x 60 60 24) */
+lval* lval_opt_partial(lopt* o, lval* v, lbuiltin f)
+{
+	if (f != builtin_add && f != builtin_mul) {return v;}
+
+	int nums = 0;
+	for (int i = 1; i < v->count; i++)
+	{
+		if (v->cell[i]->type == LVAL_NUM) {nums++;}
+	}
+	if (nums < 2) {return v;}
+
+	lval* a = lval_sexpr();
+	for (int i = 1; i < v->count; i++)
+	{
+		if (v->cell[i]->type == LVAL_NUM) {a = lval_add(a, lval_pop(v, i--));}
+	}
+	lval_opt_depend(o, v->cell[0]->sym);
+	return lval_add(v, f(o->e, a));
+}
+
+lval* lval_opt(lopt* o, lval* v)
+{
+	/* Substitute constants bound earlier in the body */
+	if (v->type == LVAL_SYM) {
+		lval* c = lenv_peek(o->consts, v->sym);
+		if (c) {lval_del(v); return lval_copy(c);}
+		return v;
+	}
+	if (v->type != LVAL_SEXPR || v->count == 0) {return v;}
+	/* A lone constant evaluates to itself */
+	if (v->count == 1 && lval_is_const(v->cell[0])) {return lval_take(v, 0);}
+
+	lval* g = lval_opt_callee(o, v->cell[0]);
+	lbuiltin f = g ? g->builtin : NULL;
+	if (f == builtin_if && v->count == 4) {return lval_opt_if(o, v);}
+
+	/* Children are evaluated left to right, so optimize them in order */
+	for (int i = 0; i < v->count; i++)
+	{
+		v->cell[i] = lval_opt(o, v->cell[i]);
+	}
+
+	if (f == builtin_put) {
+		lval_opt_bind(o, v);
+		return v;
+	}
+	/* Calls we cannot see into may rebind anything in this environment */
+	if (!g && v->cell[0]->type != LVAL_FUN) {lval_opt_forget(o);}
+
+	if (g && !g->builtin && !g->memo) {return lval_opt_inline(o, v, g);}
+	if (!lbuiltin_pure(f) || v->count < 2) {return v;}
+	for (int i = 1; i < v->count; i++)
+	{
+		if (!lval_is_const(v->cell[i])) {return lval_opt_partial(o, v, f);}
+	}
+
+	/* Fold the call, leaving errors to be raised at run time */
+	lval* a = lval_copy(v);
+	lval_del(lval_pop(a, 0));
+	lval* r = f(o->e, a);
+	if (r->type == LVAL_ERR) {lval_del(r); return v;}
+	lval_opt_depend(o, v->cell[0]->sym);
+	lval_del(v);
+	return r;
+}
+
+lval* lval_optimize(lenv* e, lval* formals, lval* body, lval** deps)
+{
+	lopt o;
+	o.e = e;
+	o.shadow = lval_copy(formals);
+	o.opaque = 0;
+	o.consts = lenv_new();
+	o.deps = lval_qexpr();
+
+	lval_opt_scan(&o, body);
+	if (!o.opaque) {body = lval_opt_code(&o, body);}
+
+	lval_del(o.shadow);
+	lenv_del(o.consts);
+	*deps = o.deps;
+	return body;
+}
+
+void lval_fun_optimize(lenv* e, lval* f)
+{
+	if (f->type != LVAL_FUN || f->builtin || f->memo) {return;}
+
+	/* Always rebuild from the body as written */
+	lval* prev = lstate->opt_dump ? lval_copy(f->body) : NULL;
+	if (f->orig) {
+		lval_del(f->body);
+		f->body = f->orig;
+		f->orig = NULL;
+	}
+	if (f->deps) {lval_del(f->deps); f->deps = NULL;}
+
+	lval* deps;
+	lval* body = lval_optimize(e, f->formals, lval_copy(f->body), &deps);
+	f->epoch = lstate->def_epoch;
+	if (lval_eq(body, f->body)) {
+		lval_del(body); lval_del(deps);
+	} else {
+		f->orig = f->body;
+		f->body = body;
+		if (deps->count) {f->deps = deps;} else {lval_del(deps);}
+	}
+
+	lval_feed_attach(f->body);
+
+	/* Only report rewrites that changed something */
+	if (prev) {
+		if (!lval_eq(prev, f->body)) {
+			printf("optimized: "); lval_print(f->orig ? f->orig : prev);
+			printf(" => "); lval_println(f->body);
+		}
+		lval_del(prev);
+	}
+}
+
+/* Rebuild global functions that relied on any of the rebound 'syms' */
+void lenv_deopt(lenv* e, lval* syms)
+{
+	for (int i = 0; i < e->count; i++)
+	{
+		lval* f = e->vals[i];
+		if (f->type != LVAL_FUN || f->builtin || f->memo || !f->deps) {continue;}
+		int stale = 0;
+		for (int j = 0; j < syms->count; j++)
+		{
+			if (lval_has_sym(f->deps, syms->cell[j]->sym)) {stale = 1;}
+		}
+		if (stale) {
+			lval_fun_optimize(e, f);
+		} else {
+			f->epoch = lstate->def_epoch;
+		}
+	}
+}
+
+/* Bytecode */
+/*
+ * Lambdas whose bodies only do number arithmetic, comparisons, 'if' and
+ * calls to other such global lambdas are compiled on their first call into
+ * code for a small stack machine working on raw longs. The arguments are
+ * checked to be numbers on entry. Everything else stays with the
+ * tree-walking evaluator. Code is tagged with 'def_epoch' and recompiled
+ * once any global binding has been replaced.
+ */
+enum {
+	OP_CONST, OP_LOCAL,
+	OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_NEG,
+	OP_GT, OP_LT, OP_GE, OP_LE, OP_EQ, OP_NE,
+	OP_JMP, OP_JMPF, OP_CALL, OP_TAILCALL, OP_RET,
+	/* Superinstructions: operate on local 'i' and constant 'k' */
+	OP_ADD_LK, OP_SUB_LK, OP_MUL_LK,
+	OP_GT_LK, OP_LT_LK, OP_GE_LK, OP_LE_LK, OP_EQ_LK, OP_NE_LK,
+	/* Superinstructions: operate on the top of stack and constant 'k' */
+	OP_ADD_K, OP_SUB_K, OP_MUL_K,
+	OP_COUNT
+};
+
+/* Instruction words, including the opcode, of each instruction */
+int lvm_oplen[OP_COUNT] = {
+	2, 2,
+	1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1,
+	2, 2, 2, 2, 1,
+	3, 3, 3,
+	3, 3, 3, 3, 3, 3,
+	2, 2, 2,
+};
+
+lcode* lcode_new(void)
+{
+	lcode* c = lmalloc(sizeof(lcode));
+	c->refs = 1;
+	c->state = LCODE_NEW;
+	c->epoch = 0;
+	c->globals = 0;
+	c->nargs = 0;
+	c->maxstack = 0;
+	c->count = 0;
+	c->ops = NULL;
+	c->thr = NULL;
+	c->nsites = 0;
+	c->sites = NULL;
+	c->calls = 0;
+	c->jit = NULL;
+	c->jitsize = 0;
+	return c;
+}
+
+/* Sites point at code by address; the epoch keeps them from going stale */
+void lcode_reset(lcode* c)
+{
+	lfree(c->ops);
+	lfree(c->thr);
+	lfree(c->sites);
+	c->ops = NULL;
+	c->thr = NULL;
+	c->sites = NULL;
+#ifdef LVM_JIT
+	if (c->jit) {munmap(c->jit, c->jitsize);}
+#endif
+	c->jit = NULL;
+	c->calls = 0;
+	c->count = 0;
+	c->nsites = 0;
+	c->maxstack = 0;
+	c->state = LCODE_NEW;
+}
+
+void lcode_release(lcode* c)
+{
+	if (--c->refs) {return;}
+	lcode_reset(c);
+	lfree(c);
+}
+
+/* Compiler */
+struct lcomp;
+typedef struct lcomp lcomp;
+struct lcomp
+{
+	lenv* root;
+	lcode* code;
+	lval* formals;
+	/* Start of the last two instructions, and of the last jump target */
+	int last;
+	int prev;
+	int label;
+	int depth;
+	/* Every code object compiled along with this one */
+	lcode** group;
+	int ngroup;
+};
+
+int lcomp_prepare(lenv* root, lval* f, lcode*** group, int* ngroup);
+
+void lcomp_word(lcomp* c, long x)
+{
+	lcode* k = c->code;
+	k->ops = lrealloc(k->ops, sizeof(lins) * (k->count+1));
+	k->ops[k->count++].i = x;
+}
+
+void lcomp_op(lcomp* c, int op, int delta)
+{
+	c->prev = c->last;
+	c->last = c->code->count;
+	lcomp_word(c, op);
+	c->depth += delta;
+	if (c->depth > c->code->maxstack) {c->code->maxstack = c->depth;}
+}
+
+long lcomp_at(lcomp* c, int pos) {return c->code->ops[pos].i;}
+
+/* Emit a binary operation, fusing it with the operands just pushed */
+void lcomp_binop(lcomp* c, int op, int op_lk, int op_k)
+{
+	int n = c->code->count;
+	int consts = c->last >= 0 && lcomp_at(c, c->last) == OP_CONST
+		&& c->label <= c->last;
+	int local = consts && c->prev >= 0 && lcomp_at(c, c->prev) == OP_LOCAL
+		&& c->label <= c->prev && c->prev + 2 == c->last;
+
+	if (local && op_lk >= 0) {
+		long i = lcomp_at(c, c->prev+1);
+		long k = lcomp_at(c, c->last+1);
+		c->code->count = c->prev;
+		c->depth -= 2;
+		c->last = c->prev = -1;
+		lcomp_op(c, op_lk, 1);
+		lcomp_word(c, i);
+		lcomp_word(c, k);
+		return;
+	}
+	if (consts && op_k >= 0 && c->last + 2 == n) {
+		long k = lcomp_at(c, c->last+1);
+		c->code->count = c->last;
+		c->depth -= 1;
+		c->last = c->prev = -1;
+		lcomp_op(c, op_k, 0);
+		lcomp_word(c, k);
+		return;
+	}
+	lcomp_op(c, op, -1);
+}
+
+int lcomp_expr(lcomp* c, lval* v, int tail);
+
+/* Compile a list as the S-Expression it will be evaluated as */
+int lcomp_list(lcomp* c, lval* v, int tail)
+{
+	if (v->count == 0) {return 0;}
+	if (v->count == 1) {return lcomp_expr(c, v->cell[0], tail);}
+
+	lval* h = v->cell[0];
+	if (h->type != LVAL_SYM || lval_has_sym(c->formals, h->sym)) {return 0;}
+	lval* g = lenv_peek(c->root, h->sym);
+	if (!g || g->type != LVAL_FUN || g->memo) {return 0;}
+	int n = v->count - 1;
+
+	lbuiltin b = g->builtin;
+	if (b == builtin_add || b == builtin_sub
+		|| b == builtin_mul || b == builtin_div) {
+		if (!lcomp_expr(c, v->cell[1], 0)) {return 0;}
+		if (n == 1 && b == builtin_sub) {lcomp_op(c, OP_NEG, 0);}
+		for (int i = 2; i <= n; i++)
+		{
+			if (!lcomp_expr(c, v->cell[i], 0)) {return 0;}
+			if (b == builtin_add) {lcomp_binop(c, OP_ADD, OP_ADD_LK, OP_ADD_K);}
+			if (b == builtin_sub) {lcomp_binop(c, OP_SUB, OP_SUB_LK, OP_SUB_K);}
+			if (b == builtin_mul) {lcomp_binop(c, OP_MUL, OP_MUL_LK, OP_MUL_K);}
+			if (b == builtin_div) {lcomp_binop(c, OP_DIV, -1, -1);}
+		}
+		if (tail) {lcomp_op(c, OP_RET, -1);}
+		return 1;
+	}
+
+	int cmp = -1, cmp_lk = -1;
+	if (b == builtin_gt) {cmp = OP_GT; cmp_lk = OP_GT_LK;}
+	if (b == builtin_lt) {cmp = OP_LT; cmp_lk = OP_LT_LK;}
+	if (b == builtin_ge) {cmp = OP_GE; cmp_lk = OP_GE_LK;}
+	if (b == builtin_le) {cmp = OP_LE; cmp_lk = OP_LE_LK;}
+	if (b == builtin_eq) {cmp = OP_EQ; cmp_lk = OP_EQ_LK;}
+	if (b == builtin_ne) {cmp = OP_NE; cmp_lk = OP_NE_LK;}
+	if (cmp >= 0) {
+		if (n != 2) {return 0;}
+		if (!lcomp_expr(c, v->cell[1], 0)) {return 0;}
+		if (!lcomp_expr(c, v->cell[2], 0)) {return 0;}
+		lcomp_binop(c, cmp, cmp_lk, -1);
+		if (tail) {lcomp_op(c, OP_RET, -1);}
+		return 1;
+	}
+
+	if (b == builtin_if) {
+		if (n != 3 || v->cell[2]->type != LVAL_QEXPR
+			|| v->cell[3]->type != LVAL_QEXPR) {return 0;}
+		if (!lcomp_expr(c, v->cell[1], 0)) {return 0;}
+		lcomp_op(c, OP_JMPF, -1);
+		int jf = c->code->count;
+		lcomp_word(c, 0);
+
+		int depth = c->depth;
+		if (!lcomp_list(c, v->cell[2], tail)) {return 0;}
+		int jmp = -1;
+		if (!tail) {
+			lcomp_op(c, OP_JMP, 0);
+			jmp = c->code->count;
+			lcomp_word(c, 0);
+		}
+
+		/* Jumps are relative to their operand */
+		c->label = c->code->count;
+		c->code->ops[jf].i = c->code->count - jf;
+		c->depth = depth;
+		if (!lcomp_list(c, v->cell[3], tail)) {return 0;}
+		if (!tail) {
+			c->label = c->code->count;
+			c->code->ops[jmp].i = c->code->count - jmp;
+		}
+		return 1;
+	}
+
+	/* Calls to other compiled lambdas, which must take every argument */
+	if (b || g->env->count || g->formals->count != n) {return 0;}
+	if (!lcomp_prepare(c->root, g, &c->group, &c->ngroup)) {return 0;}
+	for (int i = 1; i <= n; i++)
+	{
+		if (!lcomp_expr(c, v->cell[i], 0)) {return 0;}
+	}
+	lcode* k = c->code;
+	k->sites = lrealloc(k->sites, sizeof(lsite) * (k->nsites+1));
+	k->sites[k->nsites].target = g->code;
+	k->sites[k->nsites].argc = n;
+	lcomp_op(c, tail ? OP_TAILCALL : OP_CALL, 1 - n);
+	lcomp_word(c, k->nsites++);
+	return 1;
+}
+
+int lcomp_expr(lcomp* c, lval* v, int tail)
+{
+	switch (v->type)
+	{
+		case LVAL_NUM:
+			lcomp_op(c, OP_CONST, 1);
+			lcomp_word(c, v->num);
+			break;
+		case LVAL_SYM: {
+			int i = 0;
+			while (i < c->formals->count && strcmp(c->formals->cell[i]->sym, v->sym)) {i++;}
+			if (i == c->formals->count) {return 0;}
+			lcomp_op(c, OP_LOCAL, 1);
+			lcomp_word(c, i);
+			break;
+		}
+		case LVAL_SEXPR: return lcomp_list(c, v, tail);
+		default: return 0;
+	}
+	if (tail) {lcomp_op(c, OP_RET, -1);}
+	return 1;
+}
+
+void lvm_thread(lcode* c);
+
+/*
+ * Make sure lambda 'f' has code, compiling it if needed. Codes compiled
+ * while compiling 'f' are collected in 'group': if one of them fails the
+ * others may call it, so they are all sent back to be compiled again.
+ */
+int lcomp_prepare(lenv* root, lval* f, lcode*** group, int* ngroup)
+{
+	lcode* k = f->code;
+	if (k->state != LCODE_NEW && k->epoch != lstate->def_epoch) {lcode_reset(k);}
+	if (k->state == LCODE_NONE && k->globals != root->count) {lcode_reset(k);}
+	if (k->state != LCODE_NEW) {return k->state != LCODE_NONE;}
+
+	/* Bring the body up to date before compiling it */
+	if (f->deps && f->epoch != lstate->def_epoch) {lval_fun_optimize(root, f);}
+
+	lcomp c;
+	c.root = root;
+	c.code = k;
+	c.formals = f->formals;
+	c.last = c.prev = -1;
+	c.label = 0;
+	c.depth = f->formals->count;
+	c.group = group ? *group : NULL;
+	c.ngroup = group ? *ngroup : 0;
+
+	k->state = LCODE_COMPILING;
+	k->epoch = lstate->def_epoch;
+	k->globals = root->count;
+	k->nargs = f->formals->count;
+	k->maxstack = c.depth;
+	c.group = lrealloc(c.group, sizeof(lcode*) * (c.ngroup+1));
+	c.group[c.ngroup++] = k;
+
+	lval* body = lval_copy(f->body);
+	int ok = lcomp_list(&c, body, 1);
+	lval_del(body);
+
+	if (group) {
+		/* Nested compile, the outermost one decides */
+		*group = c.group;
+		*ngroup = c.ngroup;
+		return ok;
+	}
+	for (int i = 0; i < c.ngroup; i++)
+	{
+		if (ok) {
+			c.group[i]->state = LCODE_READY;
+			lvm_thread(c.group[i]);
+		} else if (c.group[i] != k) {
+			lcode_reset(c.group[i]);
+		}
+	}
+	lfree(c.group);
+	if (!ok) {
+		lcode_reset(k);
+		k->state = LCODE_NONE;
+	}
+	return ok;
+}
+
+/* Machine */
+enum {LVM_OK, LVM_DIV_ZERO, LVM_OVERFLOW, LVM_BUDGET};
+
+#define LVM_STACK  (1 << 22)
+#define LVM_FRAMES (1 << 18)
+
+struct lvm_frame
+{
+	lcode* code;
+	lins* pc;
+	long* bp;
+};
+
+/* JIT */
+/*
+ * Template JIT: code called LVM_JIT_HOT times is turned into x86-64 one
+ * instruction at a time, keeping the VM's stack layout so VM and native
+ * code can call into each other. Registers used by native code:
+ *   rbx  base of the current arguments
+ *   r12  top of the value stack
+ *   r13  end of the value stack
+ *   r14  frames left before overflow
+ *   r15  steps left of the budget, kept in 'budget_tick' outside
+ * Compiled lambdas call each other through their lcode's 'jit' field and
+ * run on a stack of their own, entered through 'ljit_enter'.
+ */
+#define LVM_JIT_HOT 1000
+
+#ifdef LVM_JIT
+#define LJIT_STACK (LVM_FRAMES * 16 + 4096)
+
+struct ljit;
+typedef struct ljit ljit;
+struct ljit
+{
+	unsigned char* buf;
+	int count;
+	int cap;
+	/* Native offset of each instruction */
+	int* at;
+	/* Jumps: where their rel32 is, and where they go */
+	int nfix;
+	int* fix;
+	int* dest;
+};
+
+/* Pseudo destinations for jumps to the error exits */
+#define LJIT_OVERFLOW -1
+#define LJIT_DIV_ZERO -2
+#define LJIT_BUDGET -3
+
+void ljit_emit(ljit* j, int n, ...)
+{
+	if (j->count + n > j->cap) {
+		j->cap = j->cap * 2 + n;
+		j->buf = realloc(j->buf, j->cap);
+	}
+	va_list va;
+	va_start(va, n);
+	for (int i = 0; i < n; i++) {j->buf[j->count++] = va_arg(va, int);}
+	va_end(va);
+}
+
+void ljit_i32(ljit* j, long x)
+{
+	ljit_emit(j, 4, (int)(x & 0xff), (int)((x >> 8) & 0xff),
+		(int)((x >> 16) & 0xff), (int)((x >> 24) & 0xff));
+}
+
+void ljit_i64(ljit* j, long x)
+{
+	ljit_i32(j, x);
+	ljit_i32(j, x >> 32);
+}
+
+int ljit_fits(long x) {return x >= -2147483648L && x <= 2147483647L;}
+
+/* rel32 operand of the jump just emitted */
+void ljit_jump(ljit* j, int dest)
+{
+	j->fix = realloc(j->fix, sizeof(int) * (j->nfix+1));
+	j->dest = realloc(j->dest, sizeof(int) * (j->nfix+1));
+	j->fix[j->nfix] = j->count;
+	j->dest[j->nfix++] = dest;
+	ljit_i32(j, 0);
+}
+
+void ljit_patch(unsigned char* p, long x)
+{
+	for (int i = 0; i < 4; i++) {p[i] = (x >> (8*i)) & 0xff;}
+}
+
+/* Copy finished code into fresh executable pages */
+void* ljit_map(ljit* j, size_t* size)
+{
+	*size = j->count;
+	void* p = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {return NULL;}
+	memcpy(p, j->buf, j->count);
+	if (mprotect(p, *size, PROT_READ | PROT_EXEC)) {
+		munmap(p, *size);
+		return NULL;
+	}
+	return p;
+}
+
+/* mov rax, [r12-8] */
+#define LJIT_LOAD_TOP(j) ljit_emit(j, 5, 0x49, 0x8B, 0x44, 0x24, 0xF8)
+/* mov [r12-8], rax */
+#define LJIT_STORE_TOP(j) ljit_emit(j, 5, 0x49, 0x89, 0x44, 0x24, 0xF8)
+/* mov [r12], rax; add r12, 8 */
+#define LJIT_PUSH(j) ljit_emit(j, 8, 0x49, 0x89, 0x04, 0x24, 0x49, 0x83, 0xC4, 0x08)
+/* sub r12, 8 */
+#define LJIT_POP(j) ljit_emit(j, 4, 0x49, 0x83, 0xEC, 0x08)
+
+/* rax = rax op k, for ADD, SUB, MUL and comparisons */
+void ljit_op_k(ljit* j, int op, long k)
+{
+	int cmp = -1;
+	switch (op)
+	{
+		case OP_GT: cmp = 0x9F; break;
+		case OP_LT: cmp = 0x9C; break;
+		case OP_GE: cmp = 0x9D; break;
+		case OP_LE: cmp = 0x9E; break;
+		case OP_EQ: cmp = 0x94; break;
+		case OP_NE: cmp = 0x95; break;
+	}
+	if (ljit_fits(k)) {
+		switch (op)
+		{
+			case OP_ADD: ljit_emit(j, 2, 0x48, 0x05); break;
+			case OP_SUB: ljit_emit(j, 2, 0x48, 0x2D); break;
+			case OP_MUL: ljit_emit(j, 3, 0x48, 0x69, 0xC0); break;
+			default: ljit_emit(j, 2, 0x48, 0x3D); break;
+		}
+		ljit_i32(j, k);
+	} else {
+		ljit_emit(j, 2, 0x48, 0xB9);
+		ljit_i64(j, k);
+		switch (op)
+		{
+			case OP_ADD: ljit_emit(j, 3, 0x48, 0x01, 0xC8); break;
+			case OP_SUB: ljit_emit(j, 3, 0x48, 0x29, 0xC8); break;
+			case OP_MUL: ljit_emit(j, 4, 0x48, 0x0F, 0xAF, 0xC1); break;
+			default: ljit_emit(j, 3, 0x48, 0x39, 0xC8); break;
+		}
+	}
+	/* setcc al; movzx eax, al */
+	if (cmp >= 0) {ljit_emit(j, 6, 0x0F, cmp, 0xC0, 0x0F, 0xB6, 0xC0);}
+}
+
+/* Operation that a superinstruction applies */
+int ljit_base(int op)
+{
+	switch (op)
+	{
+		case OP_ADD_LK: case OP_ADD_K: return OP_ADD;
+		case OP_SUB_LK: case OP_SUB_K: return OP_SUB;
+		case OP_MUL_LK: case OP_MUL_K: return OP_MUL;
+		case OP_GT_LK: return OP_GT;
+		case OP_LT_LK: return OP_LT;
+		case OP_GE_LK: return OP_GE;
+		case OP_LE_LK: return OP_LE;
+		case OP_EQ_LK: return OP_EQ;
+		case OP_NE_LK: return OP_NE;
+	}
+	return op;
+}
+
+/* Jump to 'target's native code through its 'jit' field */
+void ljit_call(ljit* j, lcode* target, int tail)
+{
+	/* mov rax, &target->jit; call/jmp [rax] */
+	ljit_emit(j, 2, 0x48, 0xB8);
+	ljit_i64(j, (long)&target->jit);
+	ljit_emit(j, 2, 0xFF, tail ? 0x20 : 0x10);
+}
+
+/* Translate 'c' into 'j', which is empty */
+void ljit_code(ljit* j, lcode* c)
+{
+	j->at = malloc(sizeof(int) * (c->count+1));
+
+	/* dec r15; jl poll */
+	ljit_emit(j, 5, 0x49, 0xFF, 0xCF, 0x0F, 0x8C);
+	ljit_jump(j, LJIT_BUDGET);
+	int resume = j->count;
+	/* dec r14; jz overflow; push rbx */
+	ljit_emit(j, 5, 0x49, 0xFF, 0xCE, 0x0F, 0x84);
+	ljit_jump(j, LJIT_OVERFLOW);
+	ljit_emit(j, 1, 0x53);
+	/* lea rbx, [r12 - nargs*8]; lea rax, [rbx + maxstack*8] */
+	ljit_emit(j, 4, 0x49, 0x8D, 0x9C, 0x24);
+	ljit_i32(j, -8L * c->nargs);
+	ljit_emit(j, 3, 0x48, 0x8D, 0x83);
+	ljit_i32(j, 8L * (c->maxstack + 1));
+	/* cmp rax, r13; jae overflow */
+	ljit_emit(j, 5, 0x4C, 0x39, 0xE8, 0x0F, 0x83);
+	ljit_jump(j, LJIT_OVERFLOW);
+
+	for (int i = 0; i < c->count; i += lvm_oplen[c->ops[i].i])
+	{
+		j->at[i] = j->count;
+		int op = c->ops[i].i;
+		long x = i+1 < c->count ? c->ops[i+1].i : 0;
+		switch (op)
+		{
+			case OP_CONST:
+				if (ljit_fits(x)) {
+					/* mov qword [r12], imm32; add r12, 8 */
+					ljit_emit(j, 4, 0x49, 0xC7, 0x04, 0x24);
+					ljit_i32(j, x);
+					ljit_emit(j, 4, 0x49, 0x83, 0xC4, 0x08);
+				} else {
+					ljit_emit(j, 2, 0x48, 0xB8);
+					ljit_i64(j, x);
+					LJIT_PUSH(j);
+				}
+				break;
+			case OP_LOCAL:
+				/* mov rax, [rbx + i*8] */
+				ljit_emit(j, 3, 0x48, 0x8B, 0x83);
+				ljit_i32(j, 8 * x);
+				LJIT_PUSH(j);
+				break;
+			case OP_ADD: case OP_SUB:
+				/* mov rax, [r12]; add/sub [r12-8], rax */
+				LJIT_POP(j);
+				ljit_emit(j, 4, 0x49, 0x8B, 0x04, 0x24);
+				ljit_emit(j, 5, 0x49, op == OP_ADD ? 0x01 : 0x29, 0x44, 0x24, 0xF8);
+				break;
+			case OP_MUL:
+				/* imul rax, [r12] */
+				LJIT_POP(j);
+				LJIT_LOAD_TOP(j);
+				ljit_emit(j, 5, 0x49, 0x0F, 0xAF, 0x04, 0x24);
+				LJIT_STORE_TOP(j);
+				break;
+			case OP_DIV:
+				/* mov rcx, [r12]; test rcx, rcx; jz div_zero */
+				LJIT_POP(j);
+				ljit_emit(j, 9, 0x49, 0x8B, 0x0C, 0x24, 0x48, 0x85, 0xC9, 0x0F, 0x84);
+				ljit_jump(j, LJIT_DIV_ZERO);
+				/* cqo; idiv rcx */
+				LJIT_LOAD_TOP(j);
+				ljit_emit(j, 5, 0x48, 0x99, 0x48, 0xF7, 0xF9);
+				LJIT_STORE_TOP(j);
+				break;
+			case OP_NEG:
+				/* neg qword [r12-8] */
+				ljit_emit(j, 5, 0x49, 0xF7, 0x5C, 0x24, 0xF8);
+				break;
+			case OP_GT: case OP_LT: case OP_GE:
+			case OP_LE: case OP_EQ: case OP_NE: {
+				int cc = op == OP_GT ? 0x9F : op == OP_LT ? 0x9C : op == OP_GE ? 0x9D
+					: op == OP_LE ? 0x9E : op == OP_EQ ? 0x94 : 0x95;
+				/* cmp rax, [r12]; setcc al; movzx eax, al */
+				LJIT_POP(j);
+				LJIT_LOAD_TOP(j);
+				ljit_emit(j, 10, 0x49, 0x3B, 0x04, 0x24, 0x0F, cc, 0xC0, 0x0F, 0xB6, 0xC0);
+				LJIT_STORE_TOP(j);
+				break;
+			}
+			case OP_JMP:
+				ljit_emit(j, 1, 0xE9);
+				ljit_jump(j, i+1 + x);
+				break;
+			case OP_JMPF:
+				/* cmp qword [r12], 0; je */
+				LJIT_POP(j);
+				ljit_emit(j, 7, 0x49, 0x83, 0x3C, 0x24, 0x00, 0x0F, 0x84);
+				ljit_jump(j, i+1 + x);
+				break;
+			case OP_CALL:
+				ljit_call(j, c->sites[x].target, 0);
+				LJIT_PUSH(j);
+				break;
+			case OP_TAILCALL: {
+				/* Move the arguments down over ours, then leave as RET does */
+				int argc = c->sites[x].argc;
+				for (int k = 0; k < argc; k++)
+				{
+					/* mov rax, [r12 - (argc-k)*8]; mov [rbx + k*8], rax */
+					ljit_emit(j, 4, 0x49, 0x8B, 0x84, 0x24);
+					ljit_i32(j, -8 * (argc-k));
+					ljit_emit(j, 3, 0x48, 0x89, 0x83);
+					ljit_i32(j, 8 * k);
+				}
+				/* lea r12, [rbx + argc*8]; pop rbx; inc r14 */
+				ljit_emit(j, 3, 0x4C, 0x8D, 0xA3);
+				ljit_i32(j, 8 * argc);
+				ljit_emit(j, 4, 0x5B, 0x49, 0xFF, 0xC6);
+				ljit_call(j, c->sites[x].target, 1);
+				break;
+			}
+			case OP_RET:
+				/* mov r12, rbx; pop rbx; inc r14; ret */
+				LJIT_LOAD_TOP(j);
+				ljit_emit(j, 8, 0x49, 0x89, 0xDC, 0x5B, 0x49, 0xFF, 0xC6, 0xC3);
+				break;
+			case OP_ADD_LK: case OP_SUB_LK: case OP_MUL_LK:
+			case OP_GT_LK: case OP_LT_LK: case OP_GE_LK:
+			case OP_LE_LK: case OP_EQ_LK: case OP_NE_LK:
+				ljit_emit(j, 3, 0x48, 0x8B, 0x83);
+				ljit_i32(j, 8 * x);
+				ljit_op_k(j, ljit_base(op), c->ops[i+2].i);
+				LJIT_PUSH(j);
+				break;
+			case OP_ADD_K: case OP_SUB_K: case OP_MUL_K:
+				LJIT_LOAD_TOP(j);
+				ljit_op_k(j, ljit_base(op), x);
+				LJIT_STORE_TOP(j);
+				break;
+		}
+	}
+
+	/* Error exits: mov eax, status; mov rcx, ljit_exit; jmp rcx */
+	int status[3] = {LVM_OVERFLOW, LVM_DIV_ZERO, LVM_BUDGET};
+	int exits[3];
+	for (int k = 0; k < 3; k++)
+	{
+		exits[k] = j->count;
+		ljit_emit(j, 1, 0xB8);
+		ljit_i32(j, status[k]);
+		ljit_emit(j, 2, 0x48, 0xB9);
+		ljit_i64(j, (long)lstate->ljit_exit);
+		ljit_emit(j, 2, 0xFF, 0xE1);
+	}
+	/*
+	 * Budget poll, entered with rsp 8 off alignment and nothing live in
+	 * scratch registers: mov rax, &budget_tick; mov [rax], r15;
+	 * sub rsp, 8; mov rax, lbudget_poll; call rax; add rsp, 8;
+	 * mov rcx, &budget_tick; mov r15, [rcx]; test eax, eax; jnz exit;
+	 * jmp resume
+	 */
+	int poll = j->count;
+	ljit_emit(j, 2, 0x48, 0xB8);
+	ljit_i64(j, (long)&lstate->budget_tick);
+	ljit_emit(j, 9, 0x4C, 0x89, 0x38, 0x48, 0x83, 0xEC, 0x08, 0x48, 0xB8);
+	ljit_i64(j, (long)lbudget_poll);
+	ljit_emit(j, 8, 0xFF, 0xD0, 0x48, 0x83, 0xC4, 0x08, 0x48, 0xB9);
+	ljit_i64(j, (long)&lstate->budget_tick);
+	ljit_emit(j, 7, 0x4C, 0x8B, 0x39, 0x85, 0xC0, 0x0F, 0x85);
+	ljit_i32(j, exits[2] - (j->count + 4));
+	ljit_emit(j, 1, 0xE9);
+	ljit_i32(j, resume - (j->count + 4));
+	for (int k = 0; k < j->nfix; k++)
+	{
+		int d = j->dest[k];
+		int to = d == LJIT_OVERFLOW ? exits[0] : d == LJIT_DIV_ZERO ? exits[1] :
+			d == LJIT_BUDGET ? poll : j->at[d];
+		ljit_patch(j->buf + j->fix[k], to - (j->fix[k] + 4));
+	}
+}
+
+/* Emit 'ljit_enter' and set up the native stack */
+int ljit_init(void)
+{
+	ljit j = {NULL, 0, 0, NULL, 0, NULL, NULL};
+	/* push rbx, rbp, r12, r13, r14, r15 */
+	ljit_emit(&j, 10, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+	/* mov rax, &ljit_rsp; mov [rax], rsp */
+	ljit_emit(&j, 2, 0x48, 0xB8);
+	ljit_i64(&j, (long)&lstate->ljit_rsp);
+	ljit_emit(&j, 3, 0x48, 0x89, 0x20);
+	/* mov rax, &ljit_out; mov [rax], rdx */
+	ljit_emit(&j, 2, 0x48, 0xB8);
+	ljit_i64(&j, (long)&lstate->ljit_out);
+	ljit_emit(&j, 3, 0x48, 0x89, 0x10);
+	/* mov r12, rsi; mov r13, rcx; mov rsp, r8 */
+	ljit_emit(&j, 9, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xCD, 0x4C, 0x89, 0xC4);
+	/* mov rax, &budget_tick; mov r15, [rax] */
+	ljit_emit(&j, 2, 0x48, 0xB8);
+	ljit_i64(&j, (long)&lstate->budget_tick);
+	ljit_emit(&j, 3, 0x4C, 0x8B, 0x38);
+	/* mov r14d, LVM_FRAMES; call rdi */
+	ljit_emit(&j, 2, 0x41, 0xBE);
+	ljit_i32(&j, LVM_FRAMES);
+	ljit_emit(&j, 2, 0xFF, 0xD7);
+	/* mov rcx, &ljit_out; mov rcx, [rcx]; mov [rcx], rax; xor eax, eax */
+	ljit_emit(&j, 2, 0x48, 0xB9);
+	ljit_i64(&j, (long)&lstate->ljit_out);
+	ljit_emit(&j, 8, 0x48, 0x8B, 0x09, 0x48, 0x89, 0x01, 0x31, 0xC0);
+	/* exit: mov rcx, &budget_tick; mov [rcx], r15 */
+	int exit = j.count;
+	ljit_emit(&j, 2, 0x48, 0xB9);
+	ljit_i64(&j, (long)&lstate->budget_tick);
+	ljit_emit(&j, 3, 0x4C, 0x89, 0x39);
+	/* mov rcx, &ljit_rsp; mov rsp, [rcx]; pop everything; ret */
+	ljit_emit(&j, 2, 0x48, 0xB9);
+	ljit_i64(&j, (long)&lstate->ljit_rsp);
+	ljit_emit(&j, 3, 0x48, 0x8B, 0x21);
+	ljit_emit(&j, 11, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3);
+
+	unsigned char* p = ljit_map(&j, &lstate->ljit_size);
+	free(j.buf);
+	lstate->ljit_stack = mmap(NULL, LJIT_STACK, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!p || lstate->ljit_stack == MAP_FAILED) {
+		if (p) {munmap(p, lstate->ljit_size);}
+		if (lstate->ljit_stack != MAP_FAILED) {munmap(lstate->ljit_stack, LJIT_STACK);}
+		lstate->ljit_stack = NULL;
+		lstate->lvm_jit_on = 0;
+		return 0;
+	}
+	lstate->ljit_enter = (ljit_entry)p;
+	lstate->ljit_exit = p + exit;
+	return 1;
+}
+
+/* Every code reachable from 'c' that isn't compiled yet */
+void ljit_collect(lcode* c, lcode*** all, int* count)
+{
+	if (c->jit) {return;}
+	for (int i = 0; i < *count; i++)
+	{
+		if ((*all)[i] == c) {return;}
+	}
+	*all = realloc(*all, sizeof(lcode*) * (*count+1));
+	(*all)[(*count)++] = c;
+	for (int i = 0; i < c->nsites; i++) {ljit_collect(c->sites[i].target, all, count);}
+}
+
+/* Compile 'c' and everything it calls, or nothing */
+int lvm_jit(lcode* c)
+{
+	if (!lstate->lvm_jit_on || (!lstate->ljit_enter && !ljit_init())) {return 0;}
+
+	lcode** all = NULL;
+	int count = 0;
+	ljit_collect(c, &all, &count);
+	void** code = malloc(sizeof(void*) * count);
+	size_t* sizes = malloc(sizeof(size_t) * count);
+	int ok = 1;
+	for (int i = 0; i < count; i++)
+	{
+		ljit j = {NULL, 0, 0, NULL, 0, NULL, NULL};
+		ljit_code(&j, all[i]);
+		code[i] = ljit_map(&j, &sizes[i]);
+		free(j.buf);
+		free(j.at);
+		free(j.fix);
+		free(j.dest);
+		if (!code[i]) {ok = 0;}
+	}
+	for (int i = 0; i < count; i++)
+	{
+		if (ok) {
+			all[i]->jit = code[i];
+			all[i]->jitsize = sizes[i];
+		} else if (code[i]) {
+			munmap(code[i], sizes[i]);
+		}
+	}
+	free(all);
+	free(code);
+	free(sizes);
+	return ok;
+}
+
+/* Run compiled 'c' on the arguments just below 'sp' */
+int lvm_jit_run(lcode* c, long* sp, long* out)
+{
+	return lstate->ljit_enter(c->jit, sp, out, lstate->lvm_stack + LVM_STACK, lstate->ljit_stack + LJIT_STACK);
+}
+
+/* Count a call to 'c', true once it runs natively */
+#define LVM_HOT(c) ((c)->jit || (++(c)->calls == LVM_JIT_HOT && lvm_jit(c)))
+#else
+#define LVM_HOT(c) 0
+int lvm_jit_run(lcode* c, long* sp, long* out) {return LVM_OK;}
+#endif
+
+/*
+ * The body of the dispatch loop, shared by the switch and the threaded
+ * versions. LVM_CASE starts an instruction, LVM_NEXT dispatches the next.
+ */
+#define LVM_LK(op) \
+	sp[0] = bp[pc[0].i] op pc[1].i; sp++; pc += 2; LVM_NEXT;
+#define LVM_BIN(op) \
+	sp--; sp[-1] = sp[-1] op sp[0]; LVM_NEXT;
+
+#define LVM_RET(v) { \
+		long ret = v; \
+		if (fp == fbase) {*out = ret; return LVM_OK;} \
+		fp--; \
+		sp = bp; *sp++ = ret; \
+		code = fp->code; pc = fp->pc; bp = fp->bp; \
+	} LVM_NEXT;
+
+#define LVM_BODY \
+	LVM_CASE(OP_CONST) *sp++ = pc->i; pc++; LVM_NEXT; \
+	LVM_CASE(OP_LOCAL) *sp++ = bp[pc->i]; pc++; LVM_NEXT; \
+	LVM_CASE(OP_ADD) LVM_BIN(+) \
+	LVM_CASE(OP_SUB) LVM_BIN(-) \
+	LVM_CASE(OP_MUL) LVM_BIN(*) \
+	LVM_CASE(OP_DIV) \
+		sp--; \
+		if (sp[0] == 0) {return LVM_DIV_ZERO;} \
+		sp[-1] /= sp[0]; LVM_NEXT; \
+	LVM_CASE(OP_NEG) sp[-1] = -sp[-1]; LVM_NEXT; \
+	LVM_CASE(OP_GT) LVM_BIN(>) \
+	LVM_CASE(OP_LT) LVM_BIN(<) \
+	LVM_CASE(OP_GE) LVM_BIN(>=) \
+	LVM_CASE(OP_LE) LVM_BIN(<=) \
+	LVM_CASE(OP_EQ) LVM_BIN(==) \
+	LVM_CASE(OP_NE) LVM_BIN(!=) \
+	LVM_CASE(OP_JMP) pc += pc->i; LVM_NEXT; \
+	LVM_CASE(OP_JMPF) \
+		sp--; \
+		pc += sp[0] ? 1 : pc->i; LVM_NEXT; \
+	LVM_CASE(OP_CALL) { \
+		lsite* s = &code->sites[pc->i]; \
+		if (LVM_HOT(s->target)) { \
+			long r; \
+			int status = lvm_jit_run(s->target, sp, &r); \
+			if (status) {return status;} \
+			sp -= s->argc; *sp++ = r; pc++; LVM_NEXT; \
+		} \
+		if (--*tick < 0 && lbudget_poll()) {return LVM_BUDGET;} \
+		if (fp == fend || sp + s->target->maxstack >= send) {return LVM_OVERFLOW;} \
+		fp->code = code; fp->pc = pc + 1; fp->bp = bp; fp++; \
+		code = s->target; \
+		bp = sp - s->argc; \
+		pc = LVM_START(code); \
+	} LVM_NEXT; \
+	LVM_CASE(OP_TAILCALL) { \
+		lsite* s = &code->sites[pc->i]; \
+		if (LVM_HOT(s->target)) { \
+			long r; \
+			int status = lvm_jit_run(s->target, sp, &r); \
+			if (status) {return status;} \
+			LVM_RET(r) \
+		} \
+		if (--*tick < 0 && lbudget_poll()) {return LVM_BUDGET;} \
+		if (bp + s->target->maxstack >= send) {return LVM_OVERFLOW;} \
+		memmove(bp, sp - s->argc, sizeof(long) * s->argc); \
+		sp = bp + s->argc; \
+		code = s->target; \
+		pc = LVM_START(code); \
+	} LVM_NEXT; \
+	LVM_CASE(OP_RET) LVM_RET(sp[-1]) \
+	LVM_CASE(OP_ADD_LK) LVM_LK(+) \
+	LVM_CASE(OP_SUB_LK) LVM_LK(-) \
+	LVM_CASE(OP_MUL_LK) LVM_LK(*) \
+	LVM_CASE(OP_GT_LK) LVM_LK(>) \
+	LVM_CASE(OP_LT_LK) LVM_LK(<) \
+	LVM_CASE(OP_GE_LK) LVM_LK(>=) \
+	LVM_CASE(OP_LE_LK) LVM_LK(<=) \
+	LVM_CASE(OP_EQ_LK) LVM_LK(==) \
+	LVM_CASE(OP_NE_LK) LVM_LK(!=) \
+	LVM_CASE(OP_ADD_K) sp[-1] += pc->i; pc++; LVM_NEXT; \
+	LVM_CASE(OP_SUB_K) sp[-1] -= pc->i; pc++; LVM_NEXT; \
+	LVM_CASE(OP_MUL_K) sp[-1] *= pc->i; pc++; LVM_NEXT;
+
+#define LVM_SETUP \
+	long* bp = lstate->lvm_stack; \
+	long* sp = bp + code->nargs; \
+	long* send = lstate->lvm_stack + LVM_STACK; \
+	lvm_frame* fbase = lstate->lvm_frames; \
+	lvm_frame* fp = fbase; \
+	lvm_frame* fend = fbase + LVM_FRAMES; \
+	long* tick = &lstate->budget_tick; \
+	if (sp + code->maxstack >= send) {return LVM_OVERFLOW;} \
+	if (--*tick < 0 && lbudget_poll()) {return LVM_BUDGET;}
+
+/* Portable version, one switch per instruction */
+int lvm_run_switch(lcode* code, long* out)
+{
+	LVM_SETUP
+	lins* pc = code->ops;
+#define LVM_START(c) ((c)->ops)
+#define LVM_CASE(op) case op:
+#define LVM_NEXT continue
+	for (;;)
+	{
+		switch ((pc++)->i)
+		{
+			LVM_BODY
+		}
+	}
+#undef LVM_START
+#undef LVM_CASE
+#undef LVM_NEXT
+}
+
+#ifdef __GNUC__
+/*
+ * Direct threaded version: every instruction jumps straight to the label
+ * of the next one. Called with no code it hands out its label table.
+ */
+int lvm_run_threaded(lcode* code, long* out, void*** labels)
+{
+#define LVM_LABEL(op) [op] = &&L_##op,
+	static void* table[OP_COUNT] = {
+		LVM_LABEL(OP_CONST) LVM_LABEL(OP_LOCAL)
+		LVM_LABEL(OP_ADD) LVM_LABEL(OP_SUB) LVM_LABEL(OP_MUL)
+		LVM_LABEL(OP_DIV) LVM_LABEL(OP_NEG)
+		LVM_LABEL(OP_GT) LVM_LABEL(OP_LT) LVM_LABEL(OP_GE)
+		LVM_LABEL(OP_LE) LVM_LABEL(OP_EQ) LVM_LABEL(OP_NE)
+		LVM_LABEL(OP_JMP) LVM_LABEL(OP_JMPF) LVM_LABEL(OP_CALL)
+		LVM_LABEL(OP_TAILCALL) LVM_LABEL(OP_RET)
+		LVM_LABEL(OP_ADD_LK) LVM_LABEL(OP_SUB_LK) LVM_LABEL(OP_MUL_LK)
+		LVM_LABEL(OP_GT_LK) LVM_LABEL(OP_LT_LK) LVM_LABEL(OP_GE_LK)
+		LVM_LABEL(OP_LE_LK) LVM_LABEL(OP_EQ_LK) LVM_LABEL(OP_NE_LK)
+		LVM_LABEL(OP_ADD_K) LVM_LABEL(OP_SUB_K) LVM_LABEL(OP_MUL_K)
+	};
+#undef LVM_LABEL
+	if (!code) {*labels = table; return LVM_OK;}
+
+	LVM_SETUP
+	lins* pc = code->thr;
+#define LVM_START(c) ((c)->thr)
+#define LVM_CASE(op) L_##op:
+#define LVM_NEXT goto *(pc++)->p
+	LVM_NEXT;
+	LVM_BODY
+#undef LVM_START
+#undef LVM_CASE
+#undef LVM_NEXT
+}
+#endif
+
+/* Build the threaded copy of the code */
+void lvm_thread(lcode* c)
+{
+#ifdef __GNUC__
+	void** labels;
+	lvm_run_threaded(NULL, NULL, &labels);
+	lfree(c->thr);
+	c->thr = lmalloc(sizeof(lins) * c->count);
+	for (int i = 0; i < c->count; i += lvm_oplen[c->ops[i].i])
+	{
+		c->thr[i].p = labels[c->ops[i].i];
+		for (int j = 1; j < lvm_oplen[c->ops[i].i]; j++) {c->thr[i+j] = c->ops[i+j];}
+	}
+#endif
+}
+
+/* Run 'f' on the VM if it compiles and 'a' holds only numbers, or NULL */
+lval* lvm_call(lenv* e, lval* f, lval* a)
+{
+	if (lstate->lvm_mode == LVM_OFF || f->env->count || a->count != f->formals->count) {
+		return NULL;
+	}
+	for (int i = 0; i < a->count; i++)
+	{
+		if (a->cell[i]->type != LVAL_NUM) {return NULL;}
+	}
+	lcode* c = f->code;
+	if (c->state != LCODE_READY || c->epoch != lstate->def_epoch) {
+		if (!lcomp_prepare(lenv_root(e), f, NULL, NULL)) {return NULL;}
+	}
+
+	if (!lstate->lvm_stack) {
+		lstate->lvm_stack = malloc(sizeof(long) * LVM_STACK);
+		lstate->lvm_frames = malloc(sizeof(lvm_frame) * LVM_FRAMES);
+	}
+	for (int i = 0; i < a->count; i++) {lstate->lvm_stack[i] = a->cell[i]->num;}
+	lval_del(a);
+
+	long r = 0;
+	int status;
+	if (LVM_HOT(c)) {
+		status = lvm_jit_run(c, lstate->lvm_stack + c->nargs, &r);
+	} else
+#ifdef __GNUC__
+	if (lstate->lvm_mode == LVM_THREADED) {
+		status = lvm_run_threaded(c, &r, NULL);
+	} else
+#endif
+	status = lvm_run_switch(c, &r);
+
+	switch (status)
+	{
+		case LVM_DIV_ZERO: return lval_error(LERR_DIV_ZERO, "division by zero!");
+		case LVM_OVERFLOW: return lval_error(LERR_OVERFLOW, "Stack overflow in compiled code.");
+		case LVM_BUDGET: return lbudget_error();
+	}
+	return lval_num(r);
+}
+
+/* Type feedback */
+/*
+ * Arithmetic and comparison call sites in lambda bodies carry an lfeed.
+ * After LFEED_WARM calls with only number operands the site is
+ * specialized: its operator is checked by pointer instead of being copied
+ * out of the environment, and the numbers are combined directly. A guard
+ * failure falls back to the generic call, and LFEED_MISSES of them turn
+ * the site generic for good.
+ */
+#define LFEED_WARM 2
+#define LFEED_MISSES 8
+
+int lfeed_op(lbuiltin fn)
+{
+	return fn == builtin_add || fn == builtin_sub || fn == builtin_mul
+		|| fn == builtin_div || fn == builtin_gt || fn == builtin_lt
+		|| fn == builtin_ge || fn == builtin_le || fn == builtin_eq
+		|| fn == builtin_ne;
+}
+
+lfeed* lfeed_new(void)
+{
+	lfeed* f = lmalloc(sizeof(lfeed));
+	f->refs = 1;
+	f->state = LFEED_COLD;
+	f->hits = 0;
+	f->misses = 0;
+	f->fn = NULL;
+	return f;
+}
+
+/* Attach feedback to every site in 'v' that names an arithmetic builtin */
+void lval_feed_attach(lval* v)
+{
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {return;}
+	char* ops[] = {"+", "-", "*", "/", ">", "<", ">=", "<=", "==", "!="};
+	if (!v->feed && v->count > 1 && v->cell[0]->type == LVAL_SYM) {
+		for (int i = 0; i < 10; i++)
+		{
+			if (strcmp(v->cell[0]->sym, ops[i])) {continue;}
+			v->feed = lfeed_new();
+			break;
+		}
+	}
+	for (int i = 0; i < v->count; i++) {lval_feed_attach(v->cell[i]);}
+}
+
+/* Apply 'fn' to the numbers in 'v' after its operator, or NULL */
+lval* lfeed_num(lbuiltin fn, lval* v)
+{
+	int n = v->count - 1;
+	lval** a = v->cell + 1;
+	long x = a[0]->num;
+
+	if (fn == builtin_sub && n == 1) {return lval_num(-x);}
+	if (fn == builtin_add) {for (int i = 1; i < n; i++) {x += a[i]->num;}}
+	if (fn == builtin_sub) {for (int i = 1; i < n; i++) {x -= a[i]->num;}}
+	if (fn == builtin_mul) {for (int i = 1; i < n; i++) {x *= a[i]->num;}}
+	if (fn == builtin_div) {
+		for (int i = 1; i < n; i++)
+		{
+			if (a[i]->num == 0) {return lval_error(LERR_DIV_ZERO, "division by zero!");}
+			x /= a[i]->num;
+		}
+	}
+	if (fn == builtin_add || fn == builtin_sub
+		|| fn == builtin_mul || fn == builtin_div) {return lval_num(x);}
+
+	/* Comparisons report their arity errors the generic way */
+	if (n != 2) {return NULL;}
+	long y = a[1]->num;
+	if (fn == builtin_gt) {return lval_num(x > y);}
+	if (fn == builtin_lt) {return lval_num(x < y);}
+	if (fn == builtin_ge) {return lval_num(x >= y);}
+	if (fn == builtin_le) {return lval_num(x <= y);}
+	if (fn == builtin_eq) {return lval_num(x == y);}
+	return lval_num(x != y);
+}
+
+/* Whether every operand of 'v' is a number */
+int lfeed_nums(lval* v)
+{
+	for (int i = 1; i < v->count; i++)
+	{
+		if (v->cell[i]->type != LVAL_NUM) {return 0;}
+	}
+	return 1;
+}
+
+/* Learn from a generic call of 'f' at a site that isn't specialized yet */
+void lfeed_record(lfeed* fb, lval* f, lval* v)
+{
+	if (f->type == LVAL_FUN && lfeed_op(f->builtin) && lfeed_nums(v)) {
+		if (++fb->hits >= LFEED_WARM) {
+			fb->state = LFEED_NUM;
+			fb->fn = f->builtin;
+		}
+	} else if (++fb->misses >= LFEED_MISSES) {
+		fb->state = LFEED_GENERIC;
+	}
+}
+
+/* Budget */
+/*
+ * Evaluated s-expressions, sequence elements and calls made by compiled
+ * code count down 'budget_tick'. When it runs out the budget is polled,
+ * at least every LBUDGET_POLL steps: the steps are charged against the
+ * fuel, the clock is read and a pending ctrl+c is picked up. Once the
+ * evaluation is stopped every further step fails too, so an error
+ * handler can't run on past it.
+ */
+#define LBUDGET_POLL 4096
+
+enum {LBUDGET_OK, LBUDGET_FUEL, LBUDGET_DEADLINE, LBUDGET_INTERRUPT, LBUDGET_MEMORY,
+	LBUDGET_CANCEL};
+
+long lbudget_now(void)
+{
+#ifdef _WIN32
+	return (long)(clock() * 1000 / CLOCKS_PER_SEC);
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+#endif
+}
+
+void lbudget_refill(void)
+{
+	long n = lstate->budget_fuel ? lstate->budget_fuel - lstate->budget_used : LONG_MAX;
+	if (n > LBUDGET_POLL) {n = LBUDGET_POLL;}
+	lstate->budget_chunk = lstate->budget_tick = n;
+}
+
+/* Make the next step poll the budget, keeping the count of steps taken */
+void lbudget_wake(void)
+{
+	lstate->budget_chunk -= lstate->budget_tick;
+	lstate->budget_tick = 0;
+}
+
+/* Start the budget of a top-level evaluation */
+void lbudget_begin(void)
+{
+	lstate->budget_used = 0;
+	lstate->budget_out = LBUDGET_OK;
+	lstate->budget_end = lstate->budget_ms ? lbudget_now() + lstate->budget_ms : 0;
+	lbudget_refill();
+	lstate->mem_over = 0;
+	lstate->budget_interrupt = 0;
+	lstate->budget_busy = 1;
+}
+
+void lbudget_end(void) {lstate->budget_busy = 0;}
+
+/* Whether tlisp_interrupt stopped this evaluation, or one it runs in place for */
+int lbudget_interrupted(void)
+{
+	for (tlisp_state_t* s = lstate; s; s = s->budget_outer)
+	{
+		if (s->budget_interrupt) {return 1;}
+	}
+	return 0;
+}
+
+/* Charge the steps taken, and whether a limit has been hit */
+int lbudget_poll(void)
+{
+	if (lstate->budget_out) {
+		lstate->budget_tick = 0;
+		return 1;
+	}
+	/* 'budget_tick' is -1: the step being taken is charged as well */
+	long steps = lstate->budget_chunk - lstate->budget_tick;
+	lstate->budget_used += steps;
+	if (lbudget_interrupted()) {
+		lstate->budget_out = LBUDGET_INTERRUPT;
+	} else if (lstate->group && lgroup_stop(lstate->group, lstate->group_at)) {
+		lstate->budget_out = LBUDGET_CANCEL;
+	} else if (lstate->mem_over) {
+		lstate->budget_out = LBUDGET_MEMORY;
+	} else if (lstate->budget_fuel && lstate->budget_used > lstate->budget_fuel) {
+		lstate->budget_out = LBUDGET_FUEL;
+	} else if (lstate->group && lgroup_spend(lstate->group, steps)) {
+		lstate->budget_out = LBUDGET_FUEL;
+	} else if (lstate->budget_end && lbudget_now() >= lstate->budget_end) {
+		lstate->budget_out = LBUDGET_DEADLINE;
+	}
+	if (lstate->budget_out) {return lbudget_poll();}
+	lbudget_refill();
+	return 0;
+}
+
+lval* lbudget_error(void)
+{
+	if (lstate->budget_out == LBUDGET_INTERRUPT) {
+		return lval_error(LERR_INTERRUPT, "Evaluation interrupted.");
+	}
+	if (lstate->budget_out == LBUDGET_MEMORY) {
+		return lval_error(LERR_LIMIT, "memory limit exceeded");
+	}
+	if (lstate->budget_out == LBUDGET_CANCEL) {
+		return lval_error(LERR_INTERRUPT, "Evaluation cancelled.");
+	}
+	if (lstate->budget_out == LBUDGET_FUEL) {
+		return lval_error(LERR_LIMIT, "Evaluation ran out of fuel after %li steps.",
+			lstate->budget_fuel);
+	}
+	return lval_error(LERR_LIMIT, "Evaluation passed its deadline of %li ms.", lstate->budget_ms);
+}
+
+/* Eval */
+lval* lval_eval_sexpr(lenv* e, lval* v) 
+{
+	/* A specialized site only checks that its operator is still the same */
+	lfeed* fb = v->feed;
+	lval* h = NULL;
+	if (v->count > 1 && v->cell[0]->type == LVAL_SYM) {
+		for (lenv* t = e; t && !h; t = t->par) {h = lenv_peek(t, v->cell[0]->sym);}
+	}
+	int fast = fb && fb->state == LFEED_NUM && h
+		&& h->type == LVAL_FUN && h->builtin == fb->fn;
+
+	/*
+	 * The operator of a call never escapes it, so a bound function is
+	 * called in place rather than copied out of its environment. It is
+	 * pinned meanwhile, in case the operands or the call rebind it.
+	 */
+	lval* borrow = !fast && h && h->type == LVAL_FUN && !h->memo ? h : NULL;
+	if (borrow) {borrow->pins++;}
+
+	/* eval children, stopping at the first error */
+	for (int i = (fast || borrow); i < v->count; i++)
+	{
+		v->cell[i] = lval_eval(e, v->cell[i]);
+		if (v->cell[i]->type == LVAL_ERR) {
+			if (borrow) {lval_unpin(borrow);}
+			return lval_take(v, i);
+		}
+	}
+	if (fast) {
+		lval* r = lfeed_nums(v) ? lfeed_num(fb->fn, v) : NULL;
+		if (r) {lval_del(v); return r;}
+		/* Guard failed, finish as a generic call */
+		if (++fb->misses >= LFEED_MISSES) {fb->state = LFEED_GENERIC;}
+		v->cell[0] = lval_eval(e, v->cell[0]);
+		if (v->cell[0]->type == LVAL_ERR) {return lval_take(v, 0);}
+	} else if (borrow) {
+		if (fb && fb->state == LFEED_COLD) {lfeed_record(fb, borrow, v);}
+		/* The operands become the argument list in place */
+		lval_del(v->cell[0]);
+		memmove(v->cell, v->cell+1, sizeof(lval*) * (v->count-1));
+		v->count--;
+		lval* r = lval_apply(e, borrow, v);
+		lval_unpin(borrow);
+		return r;
+	} else if (fb && fb->state == LFEED_COLD && v->count > 1) {
+		lfeed_record(fb, v->cell[0], v);
+	}
+	return lval_call_sexpr(e, v);
+}
+
+/* Call the first of the evaluated elements of 'v' with the rest */
+lval* lval_call_sexpr(lenv* e, lval* v)
+{
+	/* empty expression */
+	if (v->count == 0) {return v;}
+	/* single expression */
+	if (v->count == 1) {return lval_take(v, 0);}
+	/* ensure first element is a function after evaluation */
+	lval* f = lval_pop(v, 0);
+	if (f->type != LVAL_FUN) {
+		lval* err = lval_error(LERR_TYPE,
+			"S-Expression starts with incorrect type. "
+			"Got %s, Expected %s.",
+			ltype_name(f->type), ltype_name(LVAL_FUN));
+		lval_del(f); lval_del(v);
+		return err;
+	}
+	/* if so call function to get result */
+	lval* result = lval_call(e, f, v);
+	lval_del(f);
+	return result;
+}
+
+lval* lval_eval(lenv* e, lval* v)
+{
+	/* evaluate sexpressions */
+	if (v->type == LVAL_SYM) {
+		lval* x = lenv_get(e, v);
+		lval_del(v);
+		return x;
+	}
+	if (v->type == LVAL_SEXPR) {
+		if (--lstate->budget_tick < 0 && lbudget_poll()) {
+			lval_del(v);
+			return lbudget_error();
+		}
+		return lval_eval_sexpr(e, v);
+	}
+	return v;
+}
+
+/* Read */
+lval* lval_read_num(mpc_ast_t* t)
+{
+	errno = 0; 
+	long x = strtol(t->contents, NULL, 10);
+	return errno != ERANGE ?
+		lval_num(x) : lval_error(LERR_NUMBER, "invalid numuber");
+}
+
+lval* lval_read(mpc_ast_t* t)
+{
+	/* if symbol or number return conversion to that type */
+	if (strstr(t->tag, "number")) {return lval_read_num(t);}
+	if (strstr(t->tag, "symbol")) {return lval_sym(t->contents);}
+
+	/* if root (>) or sexpr then creat empty list */
+	lval* x = NULL;
+	if (strcmp(t->tag, ">") == 0) {x = lval_sexpr();}
+	if (strstr(t->tag, "sexpr"))  {x = lval_sexpr();}
+	if (strstr(t->tag, "qexpr"))  {x = lval_qexpr();}
+
+	for (int i = 0; i < t->children_num; i++)
+	{
+		if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
+		if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
+		if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
+		if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
+		if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
+		x = lval_add(x, lval_read(t->children[i]));
+	}
+	return x;
+}
+
+lval* builtin_lambda(lenv* e, lval* a)
+{
+	/* Check two args, each of which are Q-Expr */
+	LASSERT_NUM("\\", a, 2);
+	LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+
+	/* Check first Q-Expr contains only Symbols */
+	for (int i = 0; i < a->cell[0]->count; i++)
+	{
+		LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+			"Cannot define non-symbol. Got %s, Expected %s.",
+			ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+	}
+
+	/* Pop first 2 args and pass them to lval_lambda */
+	lval* formals = lval_pop(a, 0);
+	lval* body = lval_pop(a, 0);
+	lval_del(a);
+
+	lval* f = lval_lambda(formals, body);
+	lval_fun_optimize(e, f);
+	return f;
+}
+
+/* Call builtin 'f', going through the registry for one of the embedder's */
+lval* lval_call_builtin(lenv* e, lval* f, lval* a)
+{
+	if (f->builtin != builtin_native) {return f->builtin(e, a);}
+	lnative* n = &lstate->natives[f->num];
+	return n->fn(lstate, a, n->data);
+}
+
+/* Marks the lval of a registered builtin, which lval_call_builtin runs */
+lval* builtin_native(lenv* e, lval* a)
+{
+	lval_del(a);
+	return lval_err("Native builtin called outside the interpreter.");
+}
+
+lval* lval_call(lenv* e, lval* f, lval* a)
+{
+	/* if Builtin then simply call that */
+	if (f->builtin) {return lval_call_builtin(e, f, a);}
+	if (f->memo) {return lmemo_call(e, f->memo, a);}
+
+	/* Rebuild the body if a global it was optimized against has changed */
+	if (f->deps && f->epoch != lstate->def_epoch) {lval_fun_optimize(lenv_root(e), f);}
+
+	/* Every formal is given, bind straight into the function's environment */
+	if (a->count == f->formals->count) {
+		lval* r = lvm_call(e, f, a);
+		if (r) {return r;}
+		return lval_apply_in(e, f, f->env, a);
+	}
+
+	/* Record Argument Counts */
+	int given = a->count;
+	int total = f->formals->count;
+
+	/* While arguments still remain to be processed */
+	while (a->count) {
+		/* If we've ran out of formal arguments to bind */
+		if (f->formals->count == 0) {
+			lval_del(a); return lval_error(LERR_ARGS,
+					"Function passed too many arguments. "
+					"Got %i, Expected %i.", given, total);
+		}
+		/* Pop the first symbol from the formals */
+		lval* sym = lval_pop(f->formals, 0);
+		/* Pop the next argument from the list */
+		lval* val = lval_pop(a, 0);
+		/* Bind a copy into the function's environment */
+		lenv_put(f->env, sym, val);
+		/* Delete symbol and value */
+		lval_del(sym); lval_del(val);
+	}
+	/* Argument list is now bound so can be cleaned up */
+	lval_del(a);
+	/* If all formals have been bound evaluate */
+	if (f->formals->count == 0) {
+		/* Set the parent environment */
+		f->env->par = e;
+		/* Evaluate the body */
+		return builtin_eval(
+				f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+	} else {
+		/* Otherwise return partially evaluated function */
+		return lval_copy(f);
+	}
+}
+
+
+/* Bind every argument in 'a' to the formals of 'f' inside 'env', moving
+ * the values rather than copying them, then evaluate the body */
+lval* lval_apply_in(lenv* e, lval* f, lenv* env, lval* a)
+{
+	for (int i = 0; i < a->count; i++)
+	{
+		lenv_bind(env, f->formals->cell[i]->sym, a->cell[i]);
+	}
+	a->count = 0;
+	lval_del(a);
+
+	env->par = e;
+	lval* body = lval_copy(f->body);
+	body->type = LVAL_SEXPR;
+	return lval_eval(env, body);
+}
+
+/* Call 'f' without modifying it, for builtins that call a function many times */
+lval* lval_apply(lenv* e, lval* f, lval* a)
+{
+	if (f->builtin) {return lval_call_builtin(e, f, a);}
+	if (f->memo) {return lmemo_call(e, f->memo, a);}
+
+	/* Partial application and arity errors take the general path */
+	if (a->count != f->formals->count) {
+		lval* g = lval_copy(f);
+		lval* r = lval_call(e, g, a);
+		lval_del(g);
+		return r;
+	}
+
+	if (f->deps && f->epoch != lstate->def_epoch) {lval_fun_optimize(lenv_root(e), f);}
+	lval* r = lvm_call(e, f, a);
+	if (r) {return r;}
+
+	/* A fresh function's frame doesn't outlive the call, keep it on the stack */
+	if (f->env->count == 0) {
+		lenv frame = {f->env->par, 0, NULL, NULL};
+		r = lval_apply_in(e, f, &frame, a);
+		lenv_clear(&frame);
+		return r;
+	}
+	lenv* env = lenv_copy(f->env);
+	r = lval_apply_in(e, f, env, a);
+	lenv_del(env);
+	return r;
+}
+
+/* Worker Pool */
+/*
+ * pmap hands the elements of a list to a pool of worker threads owned by
+ * the interpreter. Each worker has an interpreter state of its own, with
+ * its own heap, budget, VM and native code, so nothing it allocates or
+ * mutates is shared: it evaluates against private copies of the owner's
+ * environment, made by lval_export. The owner waits while the workers
+ * run, which lets them read its environment without locks.
+ *
+ * Work is spread by stealing. The owner deals one slice of the list to
+ * each worker; a worker splits its slice in halves down to a grain size,
+ * keeping one half and pushing the other on its deque, where idle
+ * workers take it from.
+ */
+
+/* A copy of 'v' made in the current interpreter, sharing nothing with 'v' */
+lval* lval_export(lval* v);
+
+lseq* lseq_export(lseq* s)
+{
+	lseq* x = lmalloc(sizeof(lseq));
+	*x = *s;
+	x->refs = 1;
+	x->fun = s->fun ? lval_export(s->fun) : NULL;
+	x->init = s->init ? lval_export(s->init) : NULL;
+	x->src = s->src ? lseq_export(s->src) : NULL;
+	return x;
+}
+
+/* A copy of the bindings of 'e', without its parent */
+lenv* lenv_export(lenv* e)
+{
+	lenv* n = lmalloc(sizeof(lenv));
+	n->par = NULL;
+	n->count = e->count;
+	n->syms = lmalloc(sizeof(char*) * n->count);
+	n->vals = lmalloc(sizeof(lval*) * n->count);
+	for (int i = 0; i < e->count; i++)
+	{
+		n->syms[i] = lmalloc(strlen(e->syms[i]) + 1);
+		strcpy(n->syms[i], e->syms[i]);
+		n->vals[i] = lval_export(e->vals[i]);
+	}
+	return n;
+}
+
+lval* lval_export(lval* v)
+{
+	/* Caches are left behind, a memoized function starts empty */
+	if (v->type == LVAL_FUN && v->memo) {
+		return lval_memo(lval_export(v->memo->fun), v->memo->cap);
+	}
+
+	lval* x = lmalloc(sizeof(lval));
+	x->type = v->type;
+	switch (v->type)
+	{
+		case LVAL_NUM: x->num = v->num; break;
+		case LVAL_ERR: x->err = lerr_copy(v->err); break;
+		case LVAL_SYM:
+			x->sym = lmalloc(strlen(v->sym) + 1);
+			strcpy(x->sym, v->sym);
+		break;
+		case LVAL_SEQ: x->seq = lseq_export(v->seq); break;
+		/* The things shared, futures and channels work from anywhere */
+		case LVAL_FUT: x->fut = v->fut; lfuture_hold(v->fut); break;
+		case LVAL_CHAN: x->chan = v->chan; lchan_hold(v->chan); break;
+		/* Bytecode and type feedback are rebuilt by the new owner */
+		case LVAL_FUN:
+			x->builtin = v->builtin;
+			x->num = v->num;
+			x->memo = NULL;
+			x->pins = 0;
+			x->unbound = 0;
+			if (v->builtin) {break;}
+			x->env = lenv_export(v->env);
+			x->formals = lval_export(v->formals);
+			x->body = lval_export(v->body);
+			x->orig = v->orig ? lval_export(v->orig) : NULL;
+			x->deps = v->deps ? lval_export(v->deps) : NULL;
+			x->epoch = v->epoch;
+			x->code = lcode_new();
+		break;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			x->count = v->count;
+			x->cell = lmalloc(sizeof(lval*) * x->count);
+			for (int i = 0; i < x->count; i++)
+			{
+				x->cell[i] = lval_export(v->cell[i]);
+			}
+			x->feed = v->feed ? lfeed_new() : NULL;
+		break;
+	}
+	return x;
+}
+
+/* Copies of the frames of 'e' for a worker, ending in its own globals */
+lenv* lenv_export_frames(lenv* e)
+{
+	if (!e->par) {return lstate->env;}
+	lenv* n = lenv_export(e);
+	n->par = lenv_export_frames(e->par);
+	return n;
+}
+
+/*
+ * Copy into the globals 'to' those of 'from' that evaluating 'v' can
+ * reach: the symbols in it, quoted or not, and in turn the ones in what
+ * they are bound to. Code can only name what it has symbols for.
+ */
+void lenv_export_reached(lenv* to, lenv* from, lval* v)
+{
+	switch (v->type)
+	{
+		case LVAL_SYM: {
+			/* A global may shadow a builtin, so only bindings count */
+			lval* x = lenv_find(from, v->sym);
+			if (!x || lenv_find(to, v->sym)) {return;}
+			/* Bound first, so a recursive function is only followed once */
+			lenv_bind(to, v->sym, lval_export(x));
+			lenv_export_reached(to, from, x);
+			return;
+		}
+		case LVAL_FUN:
+			if (v->memo) {lenv_export_reached(to, from, v->memo->fun); return;}
+			if (v->builtin) {return;}
+			for (int i = 0; i < v->env->count; i++) {lenv_export_reached(to, from, v->env->vals[i]);}
+			lenv_export_reached(to, from, v->body);
+			if (v->orig) {lenv_export_reached(to, from, v->orig);}
+			if (v->deps) {lenv_export_reached(to, from, v->deps);}
+			return;
+		case LVAL_SEQ:
+			for (lseq* q = v->seq; q; q = q->src)
+			{
+				if (q->fun) {lenv_export_reached(to, from, q->fun);}
+				if (q->init) {lenv_export_reached(to, from, q->init);}
+			}
+			return;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			for (int i = 0; i < v->count; i++) {lenv_export_reached(to, from, v->cell[i]);}
+			return;
+	}
+}
+
+/* An interpreter working for 'o', without a grammar */
+tlisp_state_t* lworker_state(tlisp_state_t* o)
+{
+	tlisp_state_t* s = calloc(1, sizeof(tlisp_state_t));
+	s->owner = o;
+	s->root = o->root;
+	s->budget_tick = LONG_MAX;
+	tlisp_state_t* prev = tlisp_enter(s);
+	s->env = lenv_new();
+	tlisp_enter(prev);
+	return s;
+}
+
+#ifdef LPOOL
+#define LPOOL_STACK (8 << 20)
+
+struct ltask;
+struct lworker;
+typedef struct ltask ltask;
+typedef struct lworker lworker;
+
+/* Elements [lo, hi) of the work of a group */
+struct ltask
+{
+	void (*run)(lworker* w, ltask* t);
+	lgroup* group;
+	long lo;
+	long hi;
+	/* or the future to run */
+	lfuture* future;
+	/* Part of something else rather than freed once run */
+	int kept;
+};
+
+/*
+ * Deque of the tasks of one worker. The worker pushes and pops at the
+ * bottom, thieves steal from the top, so they take the oldest and
+ * largest pieces of work.
+ */
+typedef struct ldeque
+{
+	pthread_mutex_t lock;
+	ltask** items;
+	long top;
+	long bottom;
+	long cap;
+} ldeque;
+
+/* One call of a parallel builtin, which its owner waits for */
+struct lgroup
+{
+	long id;
+	tlisp_state_t* owner;
+	/* Environment of the call, and the function and list it was given */
+	lenv* env;
+	lval* fun;
+	lval* list;
+	/* Items of work, elements of 'list' in each item, and items per task */
+	long count;
+	long width;
+	long grain;
+	/* Result for each item, and the worker that made it */
+	lval** out;
+	tlisp_state_t** by;
+	/* Tasks not finished, the first item that failed, and whether to stop */
+	long pending;
+	long failed;
+	int cancel;
+	/* Steps the owner had left for all its workers together, or 0, and those they took */
+	long fuel;
+	long spent;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+struct lworker
+{
+	lpool* pool;
+	pthread_t thread;
+	ldeque deque;
+	tlisp_state_t* state;
+	unsigned seed;
+	/* Owner's globals copied at 'env_gen', and the worker's 'env_gen' then */
+	int env_gen;
+	int own_gen;
+	/* Group copied for */
+	long group;
+	/* Copies of the caller's frames and of the function of 'group' */
+	lenv* frames;
+	lval* fun;
+	/* Whether it sleeps on 'wake', which is under the lock of the pool */
+	int idle;
+	pthread_cond_t wake;
+#ifdef LGREEN
+	/* Green threads that only run here, first in first out, and their count */
+	ldeque pinned;
+	long npinned;
+	/* Where the worker goes back to when a green thread stops */
+	ucontext_t sched;
+#endif
+};
+
+#ifdef LGREEN
+/* The worker running on this thread, if it is one */
+static __thread lworker* lworker_self = NULL;
+#endif
+
+struct lpool
+{
+	int size;
+	lworker* workers;
+	long groups;
+	/* Worker the next future goes to */
+	long next;
+	/* Tasks sitting in the deques, which idle workers sleep until there are */
+	long queued;
+	int stop;
+	pthread_mutex_t lock;
+#ifdef LGREEN
+	/* Green threads not finished, and whether the pool is going */
+	lgreen* greens;
+	int closing;
+#endif
+};
+
+/*
+ * Something waiting for a channel or a future: a green thread, or else a
+ * thread, which sleeps on 'cond'. It can wait on several things at once,
+ * with a node on the queue of each, and whoever wakes it sets 'woken'.
+ */
+typedef struct lwaiter
+{
+	lgreen* green;
+	int woken;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} lwaiter;
+
+typedef struct lwaitnode
+{
+	lwaiter* waiter;
+	struct lwaitnode* next;
+	/* Whether it is on a queue, off once it is taken to be woken */
+	int listed;
+} lwaitnode;
+
+/*
+ * Nodes of waiters, oldest first, under the lock of what they wait on.
+ * How many are on it can be read without that lock.
+ */
+typedef struct lwaitq
+{
+	lwaitnode* head;
+	lwaitnode* tail;
+	long count;
+} lwaitq;
+
+#ifdef LGREEN
+/*
+ * A future evaluated on a stack of its own, which can stop part way and
+ * let its worker run something else: when it yields, or waits for a
+ * channel or another future. Until it starts any worker can steal it,
+ * then it stays on the worker it started on, as values from the
+ * interpreter of that thread may be held in its C frames.
+ */
+enum {LGREEN_NEW, LGREEN_RUNNING, LGREEN_QUEUED, LGREEN_PARKING, LGREEN_PARKED,
+	LGREEN_WOKEN, LGREEN_DONE};
+
+/* As deep as a worker's, only the pages it gets to take memory */
+#define LGREEN_STACK LPOOL_STACK
+
+struct lgreen
+{
+	lfuture* future;
+	ltask task;
+	lworker* home;
+	int status;
+	ucontext_t ctx;
+	char* stack;
+	/* Green threads of the pool */
+	lgreen* live_prev;
+	lgreen* live_next;
+};
+#endif
+
+void ldeque_push(ldeque* d, ltask* t)
+{
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom - d->top == d->cap) {
+		long cap = d->cap ? d->cap * 2 : 64;
+		ltask** items = malloc(sizeof(ltask*) * cap);
+		for (long i = d->top; i < d->bottom; i++) {items[i - d->top] = d->items[i % d->cap];}
+		free(d->items);
+		d->items = items;
+		d->bottom -= d->top;
+		d->top = 0;
+		d->cap = cap;
+	}
+	d->items[d->bottom++ % d->cap] = t;
+	pthread_mutex_unlock(&d->lock);
+}
+
+ltask* ldeque_pop(ldeque* d)
+{
+	pthread_mutex_lock(&d->lock);
+	ltask* t = d->bottom > d->top ? d->items[--d->bottom % d->cap] : NULL;
+	pthread_mutex_unlock(&d->lock);
+	return t;
+}
+
+ltask* ldeque_steal(ldeque* d)
+{
+	pthread_mutex_lock(&d->lock);
+	ltask* t = d->bottom > d->top ? d->items[d->top++ % d->cap] : NULL;
+	pthread_mutex_unlock(&d->lock);
+	return t;
+}
+
+/* Wake 'w' if it sleeps, the lock of the pool is held */
+int lworker_wake(lworker* w)
+{
+	if (!w->idle) {return 0;}
+	w->idle = 0;
+	pthread_cond_signal(&w->wake);
+	return 1;
+}
+
+/* Queue a task for worker 'w' and wake it, or another sleeping worker */
+void lpool_push(lworker* w, ltask* t)
+{
+	lpool* p = w->pool;
+	if (t->group) {__atomic_add_fetch(&t->group->pending, 1, __ATOMIC_ACQ_REL);}
+	ldeque_push(&w->deque, t);
+	__atomic_add_fetch(&p->queued, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_lock(&p->lock);
+	for (int i = 0; i < p->size && !lworker_wake(&p->workers[(w - p->workers + i) % p->size]); i++) {}
+	pthread_mutex_unlock(&p->lock);
+}
+
+#ifdef LGREEN
+/* Queue a green thread's task on its own worker, the lock of the pool is held */
+void lpool_pin_locked(lworker* w, ltask* t)
+{
+	ldeque_push(&w->pinned, t);
+	__atomic_add_fetch(&w->npinned, 1, __ATOMIC_ACQ_REL);
+	lworker_wake(w);
+}
+
+void lpool_pin(lworker* w, ltask* t)
+{
+	pthread_mutex_lock(&w->pool->lock);
+	lpool_pin_locked(w, t);
+	pthread_mutex_unlock(&w->pool->lock);
+}
+#endif
+
+/* Whether 'w' has anything to run */
+int lworker_ready(lworker* w)
+{
+#ifdef LGREEN
+	if (__atomic_load_n(&w->npinned, __ATOMIC_ACQUIRE) > 0) {return 1;}
+#endif
+	return __atomic_load_n(&w->pool->queued, __ATOMIC_ACQUIRE) > 0;
+}
+
+ltask* ltask_new(void (*run)(lworker* w, ltask* t), lgroup* g, long lo, long hi)
+{
+	ltask* t = malloc(sizeof(ltask));
+	t->run = run;
+	t->group = g;
+	t->lo = lo;
+	t->hi = hi;
+	t->future = NULL;
+	t->kept = 0;
+	return t;
+}
+
+/*
+ * The worker's green threads first, which can't run anywhere else, then
+ * its own newest task, or one stolen from another worker
+ */
+ltask* lpool_take(lworker* w)
+{
+	lpool* p = w->pool;
+#ifdef LGREEN
+	if (__atomic_load_n(&w->npinned, __ATOMIC_ACQUIRE) > 0) {
+		__atomic_sub_fetch(&w->npinned, 1, __ATOMIC_ACQ_REL);
+		return ldeque_steal(&w->pinned);
+	}
+#endif
+	ltask* t = ldeque_pop(&w->deque);
+	if (!t) {
+		w->seed = w->seed * 1103515245 + 12345;
+		int start = (w->seed >> 16) % p->size;
+		for (int i = 0; i < p->size && !t; i++)
+		{
+			lworker* v = &p->workers[(start + i) % p->size];
+			if (v != w) {t = ldeque_steal(&v->deque);}
+		}
+	}
+	if (t) {__atomic_sub_fetch(&p->queued, 1, __ATOMIC_ACQ_REL);}
+	return t;
+}
+
+/*
+ * Whether item 'i' of 'g' is not needed: the owner was interrupted, or
+ * an earlier item failed. Items before a failure carry on, so the error
+ * returned is the first one, as it would be done in order.
+ */
+int lgroup_stop(lgroup* g, long i)
+{
+	return __atomic_load_n(&g->cancel, __ATOMIC_RELAXED)
+		|| i > __atomic_load_n(&g->failed, __ATOMIC_RELAXED);
+}
+
+/* Charge 'n' steps of a worker to the fuel of 'g', whether it ran out */
+int lgroup_spend(lgroup* g, long n)
+{
+	return g->fuel && __atomic_add_fetch(&g->spent, n, __ATOMIC_RELAXED) > g->fuel;
+}
+
+/* Record that item 'i' failed, keeping the first */
+void lgroup_fail(lgroup* g, long i)
+{
+	long f = __atomic_load_n(&g->failed, __ATOMIC_RELAXED);
+	while (i < f && !__atomic_compare_exchange_n(&g->failed, &f, i, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {}
+}
+
+void lgroup_finish(lgroup* g)
+{
+	if (__atomic_sub_fetch(&g->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_lock(&g->lock);
+		pthread_cond_broadcast(&g->done);
+		pthread_mutex_unlock(&g->lock);
+	}
+}
+
+/* Wait on 'c' for a while at most, so interrupts are seen while waiting */
+void lpool_nap(pthread_cond_t* c, pthread_mutex_t* m)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	t.tv_nsec += 10000000;
+	if (t.tv_nsec >= 1000000000) {t.tv_sec++; t.tv_nsec -= 1000000000;}
+	pthread_cond_timedwait(c, m, &t);
+}
+
+/*
+ * lpool_nap for a waiter that isn't a green thread. On a worker it runs
+ * one of the worker's green threads instead, if any is ready, as they
+ * can't run anywhere else and may be what it waits for.
+ */
+void lworker_nap(pthread_cond_t* c, pthread_mutex_t* m)
+{
+#ifdef LGREEN
+	lworker* w = lworker_self;
+	if (w && __atomic_load_n(&w->npinned, __ATOMIC_ACQUIRE) > 0) {
+		tlisp_state_t* s = lstate;
+		pthread_mutex_unlock(m);
+		__atomic_sub_fetch(&w->npinned, 1, __ATOMIC_ACQ_REL);
+		ltask* t = ldeque_steal(&w->pinned);
+		t->run(w, t);
+		tlisp_enter(s);
+		pthread_mutex_lock(m);
+		return;
+	}
+#endif
+	lpool_nap(c, m);
+}
+
+/* Wait for every task of 'g', passing an interrupt of the waiter on */
+void lgroup_wait(lgroup* g)
+{
+	pthread_mutex_lock(&g->lock);
+	while (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) > 0)
+	{
+		lpool_nap(&g->done, &g->lock);
+		if (lbudget_interrupted()) {__atomic_store_n(&g->cancel, 1, __ATOMIC_RELAXED);}
+	}
+	pthread_mutex_unlock(&g->lock);
+}
+
+#ifdef LGREEN
+void lgreen_wake(lgreen* g);
+void lgreen_park(lgreen* g, lwaiter* w);
+#endif
+
+void lwaitq_push(lwaitq* q, lwaitnode* n, lwaiter* w)
+{
+	n->waiter = w;
+	n->next = NULL;
+	n->listed = 1;
+	if (q->tail) {q->tail->next = n;} else {q->head = n;}
+	q->tail = n;
+	__atomic_add_fetch(&q->count, 1, __ATOMIC_SEQ_CST);
+}
+
+lwaitnode* lwaitq_pop(lwaitq* q)
+{
+	lwaitnode* n = q->head;
+	q->head = n->next;
+	if (!q->head) {q->tail = NULL;}
+	n->listed = 0;
+	__atomic_sub_fetch(&q->count, 1, __ATOMIC_RELAXED);
+	return n;
+}
+
+/* Take 'n' off 'q'; 0 if it was taken off already, to be woken */
+int lwaitq_remove(lwaitq* q, lwaitnode* n)
+{
+	if (!n->listed) {return 0;}
+	lwaitnode* prev = NULL;
+	for (lwaitnode* x = q->head; x != n; x = x->next) {prev = x;}
+	if (prev) {prev->next = n->next;} else {q->head = n->next;}
+	if (q->tail == n) {q->tail = prev;}
+	n->listed = 0;
+	__atomic_sub_fetch(&q->count, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/* A waiter for whatever runs on this thread */
+void lwaiter_init(lwaiter* w)
+{
+	w->green = lstate->green;
+	w->woken = 0;
+	if (!w->green) {
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+	}
+}
+
+void lwaiter_end(lwaiter* w)
+{
+	if (!w->green) {
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->cond);
+	}
+}
+
+/*
+ * Wake the waiter of 'n', which was just popped. The waker holds the lock
+ * of the queue, which the waiter takes before it goes, so it is still there.
+ */
+void lwaiter_wake(lwaitnode* n)
+{
+	lwaiter* w = n->waiter;
+	__atomic_store_n(&w->woken, 1, __ATOMIC_SEQ_CST);
+#ifdef LGREEN
+	if (w->green) {lgreen_wake(w->green); return;}
+#endif
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Wait until 'w' is woken, or a while; 1 if the evaluation has to stop */
+int lwaiter_sleep(lwaiter* w)
+{
+#ifdef LGREEN
+	if (w->green) {
+		lgreen_park(w->green, w);
+	} else
+#endif
+	{
+		pthread_mutex_lock(&w->lock);
+		if (!__atomic_load_n(&w->woken, __ATOMIC_SEQ_CST)) {lworker_nap(&w->cond, &w->lock);}
+		pthread_mutex_unlock(&w->lock);
+	}
+	__atomic_store_n(&w->woken, 0, __ATOMIC_SEQ_CST);
+	return lbudget_poll();
+}
+
+/* Drop the copies a worker made for its last group */
+void lworker_release(lworker* w)
+{
+	if (w->fun) {lval_del(w->fun); w->fun = NULL;}
+	while (w->frames && w->frames != w->state->env)
+	{
+		lenv* par = w->frames->par;
+		lenv_del(w->frames);
+		w->frames = par;
+	}
+	w->frames = NULL;
+}
+
+/* Bring a worker up to date with the owner of 'g', on its first task of 'g' */
+void lworker_sync(lworker* w, lgroup* g)
+{
+	if (w->group == g->id) {return;}
+	tlisp_state_t* s = w->state;
+	tlisp_state_t* o = g->owner;
+	lworker_release(w);
+
+	/* Settings, and the globals when they have changed since last time */
+	s->lvm_mode = o->lvm_mode;
+	s->lvm_jit_on = o->lvm_jit_on;
+	s->opt_inline_size = o->opt_inline_size;
+	s->natives = o->natives;
+	s->nnatives = o->nnatives;
+	if (w->env_gen != o->env_gen || w->own_gen != s->env_gen || s->def_epoch != o->def_epoch) {
+		lenv_del(s->env);
+		s->env = lenv_export(o->env);
+		s->def_epoch = o->def_epoch;
+		w->env_gen = o->env_gen;
+		w->own_gen = s->env_gen;
+	}
+	w->frames = lenv_export_frames(g->env);
+	w->fun = lval_export(g->fun);
+
+	/* The workers share what is left of the owner's fuel */
+	s->budget_fuel = g->fuel;
+	s->budget_ms = o->budget_ms;
+	s->budget_end = o->budget_end;
+	s->budget_used = 0;
+	s->budget_out = LBUDGET_OK;
+	s->mem_limit = 0;
+	if (o->mem_limit) {
+		s->mem_limit = s->mem_used + (o->mem_limit > o->mem_used ? o->mem_limit - o->mem_used : 1);
+	}
+	s->mem_over = 0;
+	lbudget_refill();
+	s->group = g;
+	w->group = g->id;
+}
+
+void* lworker_main(void* arg)
+{
+	lworker* w = arg;
+	lpool* p = w->pool;
+	tlisp_enter(w->state);
+#ifdef LGREEN
+	lworker_self = w;
+#endif
+	for (;;)
+	{
+		ltask* t = lpool_take(w);
+		if (t) {
+			lgroup* g = t->group;
+			int kept = t->kept;
+			t->run(w, t);
+			if (!kept) {free(t);}
+			if (g) {lgroup_finish(g);}
+			continue;
+		}
+		pthread_mutex_lock(&p->lock);
+		while (!p->stop && !lworker_ready(w))
+		{
+			w->idle = 1;
+			pthread_cond_wait(&w->wake, &p->lock);
+			w->idle = 0;
+		}
+		/* Tasks still queued are run first, futures may be waiting on them */
+		int stop = p->stop && !lworker_ready(w);
+		pthread_mutex_unlock(&p->lock);
+		if (stop) {break;}
+	}
+	return NULL;
+}
+
+lpool* lpool_new(int size)
+{
+	lpool* p = calloc(1, sizeof(lpool));
+	p->size = size;
+	p->workers = calloc(size, sizeof(lworker));
+	pthread_mutex_init(&p->lock, NULL);
+
+	/* Signals such as ctrl+c are left to the threads of the embedder */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, LPOOL_STACK);
+	for (int i = 0; i < size; i++)
+	{
+		lworker* w = &p->workers[i];
+		w->pool = p;
+		w->seed = i + 1;
+		w->group = 0;
+		w->env_gen = -1;
+		pthread_mutex_init(&w->deque.lock, NULL);
+		pthread_cond_init(&w->wake, NULL);
+#ifdef LGREEN
+		pthread_mutex_init(&w->pinned.lock, NULL);
+#endif
+		w->state = lworker_state(lstate);
+	}
+	/* Only once every deque is there to steal from */
+	for (int i = 0; i < size; i++)
+	{
+		pthread_create(&p->workers[i].thread, &attr, lworker_main, &p->workers[i]);
+	}
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return p;
+}
+
+#ifdef LGREEN
+void lgreen_cancel_locked(lgreen* g);
+#endif
+
+void lpool_del(lpool* p)
+{
+	pthread_mutex_lock(&p->lock);
+#ifdef LGREEN
+	/* Green threads left waiting would never finish */
+	p->closing = 1;
+	for (lgreen* g = p->greens; g; g = g->live_next) {lgreen_cancel_locked(g);}
+#endif
+	p->stop = 1;
+	for (int i = 0; i < p->size; i++) {lworker_wake(&p->workers[i]);}
+	pthread_mutex_unlock(&p->lock);
+	for (int i = 0; i < p->size; i++) {pthread_join(p->workers[i].thread, NULL);}
+	for (int i = 0; i < p->size; i++)
+	{
+		lworker* w = &p->workers[i];
+		tlisp_state_t* prev = tlisp_enter(w->state);
+		lworker_release(w);
+		tlisp_enter(prev);
+		tlisp_state_del(w->state);
+		pthread_mutex_destroy(&w->deque.lock);
+		pthread_cond_destroy(&w->wake);
+		free(w->deque.items);
+#ifdef LGREEN
+		pthread_mutex_destroy(&w->pinned.lock);
+		free(w->pinned.items);
+#endif
+	}
+	pthread_mutex_destroy(&p->lock);
+	free(p->workers);
+	free(p);
+}
+
+/* The pool of the current interpreter, or NULL to run sequentially */
+lpool* lpool_get(void)
+{
+	if (lstate->owner) {return NULL;}
+	int size = lstate->pool_size;
+	if (size <= 0) {size = (int)sysconf(_SC_NPROCESSORS_ONLN);}
+	if (size <= 1) {return NULL;}
+	if (!lstate->pool) {lstate->pool = lpool_new(size);}
+	return lstate->pool;
+}
+
+/* Split off halves of 't' for thieves until it is down to the grain */
+void ltask_split(lworker* w, ltask* t)
+{
+	while (t->hi - t->lo > t->group->grain)
+	{
+		long mid = t->lo + (t->hi - t->lo) / 2;
+		lpool_push(w, ltask_new(t->run, t->group, mid, t->hi));
+		t->hi = mid;
+	}
+}
+
+/* Start item 'i' of 'g', which an earlier item that was dropped can't stop */
+void lworker_begin(lworker* w, lgroup* g, long i)
+{
+	tlisp_state_t* s = w->state;
+	s->group_at = i;
+	if (s->budget_out == LBUDGET_CANCEL) {
+		s->budget_out = LBUDGET_OK;
+		lbudget_refill();
+	}
+}
+
+/* Keep the result of item 'i' of 'g' */
+void lworker_end(lworker* w, lgroup* g, long i, lval* r)
+{
+	g->out[i] = r;
+	g->by[i] = w->state;
+	if (r->type == LVAL_ERR && w->state->budget_out != LBUDGET_CANCEL) {lgroup_fail(g, i);}
+}
+
+void lpmap_run(lworker* w, ltask* t)
+{
+	lgroup* g = t->group;
+	ltask_split(w, t);
+	lworker_sync(w, g);
+	for (long i = t->lo; i < t->hi && !lgroup_stop(g, i); i++)
+	{
+		lworker_begin(w, g, i);
+		lworker_end(w, g, i, lval_call1(w->frames, w->fun, lval_export(g->list->cell[i])));
+	}
+}
+
+/* Fold the elements of each item left to right, from the first */
+void lpreduce_run(lworker* w, ltask* t)
+{
+	lgroup* g = t->group;
+	ltask_split(w, t);
+	lworker_sync(w, g);
+	for (long i = t->lo; i < t->hi && !lgroup_stop(g, i); i++)
+	{
+		lworker_begin(w, g, i);
+		long lo = i * g->width;
+		long hi = lo + g->width < g->list->count ? lo + g->width : g->list->count;
+		lval* acc = lval_export(g->list->cell[lo]);
+		for (long k = lo + 1; k < hi && acc->type != LVAL_ERR; k++)
+		{
+			acc = lval_call2(w->frames, w->fun, acc, lval_export(g->list->cell[k]));
+		}
+		lworker_end(w, g, i, acc);
+	}
+}
+
+/* Evaluate each item, an argument of a call that 'par' split up */
+void lpar_run(lworker* w, ltask* t)
+{
+	lgroup* g = t->group;
+	ltask_split(w, t);
+	lworker_sync(w, g);
+	for (long i = t->lo; i < t->hi && !lgroup_stop(g, i); i++)
+	{
+		lworker_begin(w, g, i);
+		lworker_end(w, g, i, lval_eval(w->frames, lval_export(g->list->cell[i])));
+	}
+}
+
+/*
+ * Run 'run' over the elements of 'l' on the pool, 'width' elements to an
+ * item, and wait for it. The result of each item is left in 'g', in the
+ * memory of the worker that made it.
+ */
+void lpool_run(lpool* p, lgroup* g, void (*run)(lworker* w, ltask* t),
+	lenv* e, lval* f, lval* l, long width)
+{
+	long n = (l->count + width - 1) / width;
+	g->id = ++p->groups;
+	g->owner = lstate;
+	g->env = e;
+	g->fun = f;
+	g->list = l;
+	g->count = n;
+	g->width = width;
+	g->grain = n / (p->size * 8);
+	if (g->grain < 1) {g->grain = 1;}
+	g->out = lcalloc(n, sizeof(lval*));
+	g->by = lcalloc(n, sizeof(tlisp_state_t*));
+	g->pending = 0;
+	g->failed = LONG_MAX;
+	g->cancel = 0;
+	g->fuel = 0;
+	if (lstate->budget_fuel) {
+		g->fuel = lstate->budget_fuel > lstate->budget_used ? lstate->budget_fuel - lstate->budget_used : 1;
+	}
+	g->spent = 0;
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->done, NULL);
+
+	/* One slice per worker to start with, stealing evens out the rest */
+	for (int i = 0; i < p->size; i++)
+	{
+		long lo = n * i / p->size;
+		long hi = n * (i + 1) / p->size;
+		if (lo < hi) {lpool_push(&p->workers[i], ltask_new(run, g, lo, hi));}
+	}
+	lgroup_wait(g);
+	pthread_mutex_destroy(&g->lock);
+	pthread_cond_destroy(&g->done);
+
+	/* Charge the owner for the steps the workers took */
+	for (int i = 0; i < p->size; i++)
+	{
+		lworker* w = &p->workers[i];
+		if (w->group != g->id) {continue;}
+		tlisp_state_t* s = w->state;
+		lstate->budget_used += s->budget_used;
+		if (!s->budget_out) {lstate->budget_used += s->budget_chunk - s->budget_tick;}
+		s->group = NULL;
+	}
+	lbudget_wake();
+}
+
+/* Free result 'i' of 'g' in the worker that made it */
+void lgroup_drop(lgroup* g, long i)
+{
+	if (!g->out[i]) {return;}
+	tlisp_state_t* prev = tlisp_enter(g->by[i]);
+	lval_del(g->out[i]);
+	tlisp_enter(prev);
+	g->out[i] = NULL;
+}
+
+/* The error 'g' failed with, or NULL, and free the results of 'g' */
+lval* lgroup_end(lgroup* g)
+{
+	lval* err = NULL;
+	if (g->failed != LONG_MAX) {
+		err = lval_export(g->out[g->failed]);
+	} else if (g->cancel) {
+		/* Only an interrupt of the owner cancels without a failure */
+		lbudget_poll();
+		err = lbudget_error();
+	}
+	for (long i = 0; i < g->count; i++) {lgroup_drop(g, i);}
+	lfree(g->out);
+	lfree(g->by);
+	return err;
+}
+#else
+int lgroup_stop(lgroup* g, long i) {return 0;}
+int lgroup_spend(lgroup* g, long n) {return 0;}
+void lpool_del(lpool* p) {}
+#endif
+
+/* Futures */
+/*
+ * spawn starts evaluating an expression on the pool and returns a
+ * future for its result, which await waits for. Each future evaluates in
+ * an interpreter of its own, given copies of the caller's frames and of
+ * the globals its expression can reach when it is spawned, so it runs
+ * alongside its caller without sharing anything but the future itself.
+ * Code it receives later, over a channel, finds only those globals. Like a top-level evaluation it
+ * gets the fuel, deadline and memory limit of the interpreter.
+ *
+ * Whoever starts the evaluation first runs it: a worker, or await when
+ * no worker has got to it yet. A future nobody holds any more is
+ * cancelled.
+ */
+struct lfuture
+{
+	/* Values and queued tasks holding it, and whether it has been started */
+	int holds;
+	int started;
+	/* Interpreter it runs in, frames and expression given, and the result */
+	tlisp_state_t* state;
+	lenv* env;
+	lval* expr;
+	lval* result;
+	/* The mailbox of an actor, which it handles messages from */
+	lchan* mailbox;
+#ifdef LPOOL
+	/* A group of one item, done when nothing is pending */
+	lgroup group;
+	/* Whether it runs as a green thread */
+	int is_green;
+#endif
+#ifdef LGREEN
+	/* That thread while it runs, and green threads awaiting it */
+	lgreen* green;
+	lwaitq waiters;
+#endif
+};
+
+void lfuture_hold(lfuture* f)
+{
+#ifdef LPOOL
+	pthread_mutex_lock(&f->group.lock);
+	f->holds++;
+	pthread_mutex_unlock(&f->group.lock);
+#else
+	f->holds++;
+#endif
+}
+
+void lfuture_del(lfuture* f)
+{
+	tlisp_state_t* s = f->state;
+	tlisp_state_t* prev = tlisp_enter(s);
+	if (f->expr) {lval_del(f->expr);}
+	if (f->result) {lval_del(f->result);}
+	while (f->env != s->env)
+	{
+		lenv* par = f->env->par;
+		lenv_del(f->env);
+		f->env = par;
+	}
+	tlisp_enter(prev);
+	if (f->mailbox) {lchan_drop(f->mailbox);}
+	free(s->natives);
+	tlisp_state_del(s);
+#ifdef LPOOL
+	pthread_mutex_destroy(&f->group.lock);
+	pthread_cond_destroy(&f->group.done);
+#endif
+	free(f);
+}
+
+#ifdef LPOOL
+/* Stop 'f', waking it up if it waits, under its lock */
+void lfuture_cancel_locked(lfuture* f)
+{
+	__atomic_store_n(&f->group.cancel, 1, __ATOMIC_SEQ_CST);
+#ifdef LGREEN
+	if (f->green) {lgreen_wake(f->green);}
+#endif
+}
+
+/* Mark 'f' done, and wake the green threads awaiting it */
+void lfuture_done(lfuture* f)
+{
+	lgroup_finish(&f->group);
+#ifdef LGREEN
+	pthread_mutex_lock(&f->group.lock);
+	while (f->waiters.head) {lwaiter_wake(lwaitq_pop(&f->waiters));}
+	pthread_mutex_unlock(&f->group.lock);
+#endif
+}
+
+/* Wait for 'f' on this thread; 1 if the evaluation has to stop, which cancels 'f' */
+int lfuture_wait(lfuture* f)
+{
+	int out = 0;
+	pthread_mutex_lock(&f->group.lock);
+	while (!out && __atomic_load_n(&f->group.pending, __ATOMIC_ACQUIRE) > 0)
+	{
+		lworker_nap(&f->group.done, &f->group.lock);
+		if ((out = lbudget_poll())) {lfuture_cancel_locked(f);}
+	}
+	pthread_mutex_unlock(&f->group.lock);
+	return out;
+}
+#endif
+
+int lfuture_is_actor(lfuture* f) {return f->mailbox != NULL;}
+
+/* Let go of 'f', cancelling it once only its task is left holding it */
+void lfuture_drop(lfuture* f)
+{
+#ifdef LPOOL
+	/* Locked, so the cancel is done with before anyone can free 'f' */
+	pthread_mutex_lock(&f->group.lock);
+	int n = --f->holds;
+	/* An actor handles what it was sent once no more can be, a green thread runs to the end */
+	if (n == 1 && f->mailbox) {
+		lchan_close(f->mailbox);
+	} else if (n == 1 && !f->is_green) {
+		lfuture_cancel_locked(f);
+	}
+	pthread_mutex_unlock(&f->group.lock);
+#else
+	int n = --f->holds;
+#endif
+	if (n == 0) {lfuture_del(f);}
+}
+
+/* Whether the caller is the one to run 'f' */
+int lfuture_claim(lfuture* f)
+{
+#ifdef LPOOL
+	int no = 0;
+	return __atomic_compare_exchange_n(&f->started, &no, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+#else
+	return !f->started++;
+#endif
+}
+
+void lactor_run(lfuture* f);
+
+/* Evaluate 'f' on the calling thread, in its own interpreter */
+void lfuture_run(lfuture* f)
+{
+	tlisp_state_t* prev = tlisp_enter(f->state);
+	/*
+	 * Run by await or spawn in place, an interrupt of the caller stops it.
+	 * A green thread has entered its own state already.
+	 */
+	lstate->budget_outer = prev != lstate ? prev : NULL;
+#ifdef LPOOL
+	lstate->group = &f->group;
+	lstate->group_at = 0;
+#endif
+	if (f->mailbox) {
+		lactor_run(f);
+	} else {
+		lbudget_begin();
+		lval* x = f->expr;
+		f->expr = NULL;
+		x->type = LVAL_SEXPR;
+		f->result = lval_eval(f->env, x);
+		lbudget_end();
+	}
+	lstate->budget_outer = NULL;
+	tlisp_enter(prev);
+#ifdef LPOOL
+	lfuture_done(f);
+#endif
+}
+
+lval* lval_future(lfuture* f)
+{
+	lval* v = lmalloc(sizeof(lval));
+	v->type = LVAL_FUT;
+	v->fut = f;
+	return v;
+}
+
+/* A future for the Q-Expression 'q', in the frames 'e' of the caller */
+lfuture* lfuture_new(lenv* e, lval* q)
+{
+	lfuture* f = calloc(1, sizeof(lfuture));
+	f->holds = 1;
+	tlisp_state_t* o = lstate;
+	tlisp_state_t* s = f->state = lworker_state(o);
+	s->lvm_mode = o->lvm_mode;
+	s->lvm_jit_on = o->lvm_jit_on;
+	s->opt_inline_size = o->opt_inline_size;
+	s->def_epoch = o->def_epoch;
+	/* A copy, the caller may register more while this runs */
+	s->natives = malloc(sizeof(lnative) * (o->nnatives + 1));
+	if (o->nnatives) {memcpy(s->natives, o->natives, sizeof(lnative) * o->nnatives);}
+	s->nnatives = o->nnatives;
+	s->budget_fuel = o->budget_fuel;
+	s->budget_ms = o->budget_ms;
+	s->mem_limit = o->mem_limit;
+
+	/* Only the globals it can get to, copying them all would make spawning slow */
+	tlisp_state_t* prev = tlisp_enter(s);
+	f->env = lenv_export_frames(e);
+	f->expr = lval_export(q);
+	lenv_export_reached(s->env, o->env, q);
+	for (lenv* t = e; t->par; t = t->par)
+	{
+		for (int i = 0; i < t->count; i++) {lenv_export_reached(s->env, o->env, t->vals[i]);}
+	}
+	tlisp_enter(prev);
+	if (s->mem_limit) {s->mem_limit += s->mem_used;}
+
+#ifdef LPOOL
+	f->group.id = 0;
+	f->group.count = 1;
+	f->group.pending = 1;
+	f->group.failed = LONG_MAX;
+	f->group.cancel = 0;
+	/* A future has fuel of its own */
+	f->group.fuel = 0;
+	f->group.spent = 0;
+	pthread_mutex_init(&f->group.lock, NULL);
+	pthread_cond_init(&f->group.done, NULL);
+#endif
+	return f;
+}
+
+#ifdef LPOOL
+void lfuture_task(lworker* w, ltask* t)
+{
+	lfuture* f = t->future;
+	if (lfuture_claim(f)) {
+		/* Nobody is waiting for it any more */
+		if (lgroup_stop(&f->group, 0)) {
+			lfuture_done(f);
+		} else {
+			lfuture_run(f);
+		}
+	}
+	lfuture_drop(f);
+}
+
+/* Run 'f' on 'p', futures are dealt to the workers in turn */
+void lfuture_start(lpool* p, lfuture* f)
+{
+	ltask* t = ltask_new(lfuture_task, NULL, 0, 1);
+	t->future = f;
+	lfuture_hold(f);
+	lpool_push(&p->workers[p->next++ % p->size], t);
+}
+#endif
+
+lval* builtin_spawn(lenv* e, lval* a)
+{
+	LASSERT_NUM("spawn", a, 1);
+	LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
+
+	lfuture* f = lfuture_new(e, a->cell[0]);
+	lval_del(a);
+#ifdef LPOOL
+	lpool* p = lpool_get();
+	if (p) {
+		lfuture_start(p, f);
+	} else
+#endif
+	/* Without a pool it is evaluated here and now */
+	if (lfuture_claim(f)) {lfuture_run(f);}
+	return lval_future(f);
+}
+
+lval* builtin_await(lenv* e, lval* a)
+{
+	LASSERT_NUM("await", a, 1);
+	LASSERT_TYPE("await", a, 0, LVAL_FUT);
+
+	lfuture* f = a->cell[0]->fut;
+#ifdef LGREEN
+	/* A green thread is only ever run by its own */
+	int mine = !f->is_green && lfuture_claim(f);
+#else
+	int mine = lfuture_claim(f);
+#endif
+	if (mine) {
+		/* Held meanwhile, so the task that lost the claim can't be the last holder and cancel it */
+		lfuture_hold(f);
+		lfuture_run(f);
+		lfuture_drop(f);
+	}
+#ifdef LGREEN
+	if (lstate->green) {
+		/* A green thread parks until the future is done */
+		lwaiter w;
+		lwaitnode n;
+		lwaiter_init(&w);
+		int out = 0;
+		pthread_mutex_lock(&f->group.lock);
+		while (!out && __atomic_load_n(&f->group.pending, __ATOMIC_ACQUIRE) > 0)
+		{
+			lwaitq_push(&f->waiters, &n, &w);
+			pthread_mutex_unlock(&f->group.lock);
+			out = lwaiter_sleep(&w);
+			pthread_mutex_lock(&f->group.lock);
+			lwaitq_remove(&f->waiters, &n);
+		}
+		pthread_mutex_unlock(&f->group.lock);
+		if (out) {
+			lval_del(a);
+			return lbudget_error();
+		}
+	} else
+#endif
+#ifdef LPOOL
+	/* Running out of budget while waiting cancels the future too */
+	if (lfuture_wait(f)) {
+		lval_del(a);
+		return lbudget_error();
+	}
+#endif
+	lval* r = lval_export(f->result);
+	lval_del(a);
+	return r;
+}
+
+/* Green Threads */
+/*
+ * spawn-green is spawn for a great many small evaluations: each runs as a
+ * green thread, on a stack of its own, which stops whenever it yields or
+ * waits for a channel or a future and lets its worker run another one.
+ * Several green threads are multiplexed onto each worker of the pool,
+ * which always has at least one worker for them. Unlike a future, a
+ * green thread runs to the end when nobody holds it any more; those left
+ * when the pool goes are cancelled. Anything else that waits on a worker
+ * runs its green threads meanwhile. Without ucontext spawn-green is an error.
+ */
+#ifdef LGREEN
+/* Whether 'g' was parked and is to be queued now, else if it is parking it sees the wake */
+int lgreen_unpark(lgreen* g)
+{
+	int s = LGREEN_PARKED;
+	if (__atomic_compare_exchange_n(&g->status, &s, LGREEN_QUEUED, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		return 1;
+	}
+	s = LGREEN_PARKING;
+	__atomic_compare_exchange_n(&g->status, &s, LGREEN_WOKEN, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/*
+ * Let 'g' run again if it waits. The waker holds the lock of what 'g'
+ * waits on, or of its future, so 'g' can't finish and be freed meanwhile.
+ */
+void lgreen_wake(lgreen* g)
+{
+	if (lgreen_unpark(g)) {lpool_pin(g->home, &g->task);}
+}
+
+/* Cancel 'g' and wake it to see that, the lock of the pool is held */
+void lgreen_cancel_locked(lgreen* g)
+{
+	__atomic_store_n(&g->future->group.cancel, 1, __ATOMIC_SEQ_CST);
+	if (lgreen_unpark(g)) {lpool_pin_locked(g->home, &g->task);}
+}
+
+/* Park the running green thread 'g' until its waiter 'w' is woken, or it is cancelled */
+void lgreen_park(lgreen* g, lwaiter* w)
+{
+	__atomic_store_n(&g->status, LGREEN_PARKING, __ATOMIC_SEQ_CST);
+	/* A wake or cancel from now on unparks it, one from before is seen here */
+	if (__atomic_load_n(&w->woken, __ATOMIC_SEQ_CST)
+		|| __atomic_load_n(&g->future->group.cancel, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&g->status, LGREEN_RUNNING, __ATOMIC_SEQ_CST);
+	} else {
+		swapcontext(&g->ctx, &g->home->sched);
+	}
+}
+
+void lgreen_main(void)
+{
+	lgreen* g = lstate->green;
+	lfuture_run(g->future);
+	__atomic_store_n(&g->status, LGREEN_DONE, __ATOMIC_SEQ_CST);
+}
+
+/* Free 'g', which is done, along with its hold on its future */
+void lgreen_end(lgreen* g)
+{
+	lfuture* f = g->future;
+	lpool* p = g->home->pool;
+	pthread_mutex_lock(&p->lock);
+	if (g->live_prev) {g->live_prev->live_next = g->live_next;} else {p->greens = g->live_next;}
+	if (g->live_next) {g->live_next->live_prev = g->live_prev;}
+	pthread_mutex_unlock(&p->lock);
+	pthread_mutex_lock(&f->group.lock);
+	f->green = NULL;
+	pthread_mutex_unlock(&f->group.lock);
+	f->state->green = NULL;
+	if (g->stack) {munmap(g->stack, LGREEN_STACK);}
+	free(g);
+	lfuture_drop(f);
+}
+
+/* Run the green thread of 't' on 'w' until it is done or stops */
+void lgreen_task(lworker* w, ltask* t)
+{
+	lfuture* f = t->future;
+	lgreen* g = f->green;
+	if (!g->home) {
+		g->home = w;
+		/* Nobody is waiting for it any more */
+		if (lgroup_stop(&f->group, 0)) {
+			lfuture_done(f);
+			lgreen_end(g);
+			return;
+		}
+		g->stack = mmap(NULL, LGREEN_STACK, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		if (g->stack == MAP_FAILED) {
+			/* Then it runs to the end on the worker's stack */
+			g->stack = NULL;
+			f->state->green = NULL;
+			lfuture_run(f);
+			lgreen_end(g);
+			return;
+		}
+		/* The lowest page catches an overflow */
+		mprotect(g->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+		getcontext(&g->ctx);
+		g->ctx.uc_stack.ss_sp = g->stack;
+		g->ctx.uc_stack.ss_size = LGREEN_STACK;
+		g->ctx.uc_link = &w->sched;
+		makecontext(&g->ctx, lgreen_main, 0);
+	}
+	tlisp_enter(f->state);
+	__atomic_store_n(&g->status, LGREEN_RUNNING, __ATOMIC_SEQ_CST);
+	swapcontext(&w->sched, &g->ctx);
+	tlisp_enter(w->state);
+
+	int s = __atomic_load_n(&g->status, __ATOMIC_SEQ_CST);
+	if (s == LGREEN_DONE) {lgreen_end(g); return;}
+	/* Parked, unless it was woken on its way out */
+	if (s == LGREEN_PARKING && __atomic_compare_exchange_n(&g->status, &s, LGREEN_PARKED, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+	__atomic_store_n(&g->status, LGREEN_QUEUED, __ATOMIC_SEQ_CST);
+	lpool_pin(w, t);
+}
+
+/* The pool of the first interpreter, which green threads run on */
+lpool* lpool_green(void)
+{
+	tlisp_state_t* s = lstate;
+	while (s->owner) {s = s->owner;}
+	if (s == lstate && !s->pool) {
+		int size = s->pool_size;
+		if (size <= 0) {size = (int)sysconf(_SC_NPROCESSORS_ONLN);}
+		s->pool = lpool_new(size > 1 ? size : 1);
+	}
+	return s->pool;
+}
+
+/* Run 'f' as a green thread on 'p' */
+void lgreen_start(lpool* p, lfuture* f)
+{
+	lgreen* g = calloc(1, sizeof(lgreen));
+	g->future = f;
+	g->task.run = lgreen_task;
+	g->task.future = f;
+	g->task.kept = 1;
+	f->is_green = 1;
+	f->green = g;
+	f->state->green = g;
+	lfuture_hold(f);
+
+	pthread_mutex_lock(&p->lock);
+	g->live_next = p->greens;
+	if (p->greens) {p->greens->live_prev = g;}
+	p->greens = g;
+	if (p->closing) {__atomic_store_n(&f->group.cancel, 1, __ATOMIC_SEQ_CST);}
+	pthread_mutex_unlock(&p->lock);
+
+	/* Spawned from a green thread it goes on the same worker, for others to steal */
+	lworker* w = lstate->green ? lstate->green->home
+		: &p->workers[__atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED) % p->size];
+	lpool_push(w, &g->task);
+}
+#endif
+
+lval* builtin_spawn_green(lenv* e, lval* a)
+{
+#ifdef LGREEN
+	LASSERT_NUM("spawn-green", a, 1);
+	LASSERT_TYPE("spawn-green", a, 0, LVAL_QEXPR);
+
+	lpool* p = lpool_green();
+	if (p) {
+		lfuture* f = lfuture_new(e, a->cell[0]);
+		lval_del(a);
+		lgreen_start(p, f);
+		return lval_future(f);
+	}
+#endif
+	/*
+	 * A future in its place would be cancelled when let go of, and
+	 * pipelines of them would hold up every worker waiting.
+	 */
+	lval_del(a);
+	return lval_error(LERR_OTHER, "Function 'spawn-green' needs green threads, which this build does not have.");
+}
+
+/* Let other green threads of the worker run, outside of one it does nothing */
+lval* builtin_yield(lenv* e, lval* a)
+{
+	LASSERT(a, a->count <= 1,
+		"Function 'yield' passed incorrect number of arguments. "
+		"Got %i, Expected 0 or 1.", a->count);
+	lval_del(a);
+#ifdef LGREEN
+	lgreen* g = lstate->green;
+	if (g) {
+		__atomic_store_n(&g->status, LGREEN_QUEUED, __ATOMIC_SEQ_CST);
+		swapcontext(&g->ctx, &g->home->sched);
+	}
+#endif
+	return lval_sexpr();
+}
+
+/* Channels */
+/*
+ * (chan n) makes a channel holding up to 'n' values, which send puts
+ * values into and recv takes out of, oldest first; select does whichever
+ * of several sends and receives can go ahead first. They wait while they
+ * can't: a green thread parks and lets its worker run others, any other
+ * evaluation sleeps. Once a channel is closed what is in it can still
+ * be taken, then receiving is an error, as sending is straight away.
+ * Like a future, a channel is shared by every interpreter it is passed
+ * to. A value sent moves over without a copy unless it shares something
+ * with the sender, such as a lambda's bytecode. Its ring and the values
+ * waiting in it are charged to the root interpreter, which every one
+ * under it counts against its limit; a value taken is charged to the
+ * receiver from then on.
+ *
+ * The values sit in a ring of slots, each with the turn it is ready for:
+ * twice the position of the next value to go in it, one more once that
+ * is in, so a full slot never looks like one free for the next lap.
+ * Senders and receivers claim a position with a compare and swap and
+ * never lock, unless the ring is full or empty and they have to wait.
+ */
+typedef struct lslot
+{
+	long turn;
+	lval* val;
+	/* Bytes 'val' was charged */
+	size_t bytes;
+} lslot;
+
+struct lchan
+{
+	/* Values holding it */
+	int holds;
+	int closed;
+	long cap;
+	lslot* slots;
+	/* The interpreter its ring and queued values are charged to */
+	tlisp_state_t* root;
+	/* Values sent and taken so far, on cache lines of their own */
+	char pad0[64];
+	long sent;
+	char pad1[64];
+	long taken;
+	char pad2[64];
+#ifdef LPOOL
+	/* Waiters, whose counts senders and receivers check before locking */
+	pthread_mutex_t lock;
+	lwaitq senders;
+	lwaitq receivers;
+#endif
+};
+
+/* Bytes charged for the block 'p' */
+size_t lmem_size(void* p)
+{
+	return p ? ((lmem_head*)p - 1)->size : 0;
+}
+
+/* Bytes charged for 'v' and everything in it */
+size_t lval_bytes(lval* v)
+{
+	size_t n = lmem_size(v);
+	switch (v->type)
+	{
+		case LVAL_SYM: n += lmem_size(v->sym); break;
+		case LVAL_ERR: n += lmem_size(v->err) + lmem_size(v->err->msg); break;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			n += lmem_size(v->cell);
+			for (int i = 0; i < v->count; i++) {n += lval_bytes(v->cell[i]);}
+		break;
+	}
+	return n;
+}
+
+/* Whether 'v' shares nothing with this interpreter but futures and channels */
+int lval_movable(lval* v)
+{
+	switch (v->type)
+	{
+		case LVAL_SEQ: return 0;
+		case LVAL_FUN: return v->builtin && !v->memo;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			for (int i = 0; i < v->count; i++)
+			{
+				if (!lval_movable(v->cell[i])) {return 0;}
+			}
+			return 1;
+		default: return 1;
+	}
+}
+
+/* Drop the type feedback of the calls in 'v', it is this interpreter's */
+void lval_unfeed(lval* v)
+{
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {return;}
+	if (v->feed) {
+		if (--v->feed->refs == 0) {lfree(v->feed);}
+		v->feed = NULL;
+	}
+	for (int i = 0; i < v->count; i++) {lval_unfeed(v->cell[i]);}
+}
+
+/*
+ * 'v' ready to move to another interpreter, and no longer charged to
+ * this one; 'n' gets the bytes lval_attach charges whoever takes it
+ */
+lval* lval_detach(lval* v, size_t* n)
+{
+	if (lval_movable(v)) {
+		lval_unfeed(v);
+		*n = lval_bytes(v);
+	} else {
+		size_t used = lstate->mem_used;
+		lval* x = lval_export(v);
+		*n = lstate->mem_used - used;
+		lval_del(v);
+		v = x;
+	}
+	lmem_charge(-(long)*n);
+	return v;
+}
+
+lval* lval_attach(lval* v, size_t n)
+{
+	lmem_charge((long)n);
+	return v;
+}
+
+/*
+ * Charge 'n' bytes, or free -n, to the root interpreter of 'c', which
+ * every interpreter under it counts against its limit. Going over stops
+ * the evaluation charging, as an allocation would.
+ */
+void lchan_charge(lchan* c, long n)
+{
+#ifdef LPOOL
+	__atomic_add_fetch(&c->root->mem_chans, n, __ATOMIC_RELAXED);
+#else
+	c->root->mem_chans += n;
+#endif
+	if (n > 0) {lmem_charge(0);}
+}
+
+void lchan_hold(lchan* c)
+{
+#ifdef LPOOL
+	__atomic_add_fetch(&c->holds, 1, __ATOMIC_RELAXED);
+#else
+	c->holds++;
+#endif
+}
+
+void lchan_drop(lchan* c)
+{
+#ifdef LPOOL
+	int n = __atomic_sub_fetch(&c->holds, 1, __ATOMIC_ACQ_REL);
+#else
+	int n = --c->holds;
+#endif
+	if (n) {return;}
+	/* Values left in it are freed by whoever let go last */
+	for (long i = c->taken; i < c->sent; i++)
+	{
+		lslot* s = &c->slots[i % c->cap];
+		lchan_charge(c, -(long)s->bytes);
+		lval_del(lval_attach(s->val, s->bytes));
+	}
+#ifdef LPOOL
+	pthread_mutex_destroy(&c->lock);
+#endif
+	long ring = (long)lmem_size(c->slots);
+	lchan_charge(c, -ring);
+	lmem_charge(ring);
+	lfree(c->slots);
+	free(c);
+}
+
+/* Put 'x', charged 'n' bytes, into 'c' unless it is full */
+int lchan_put(lchan* c, lval* x, size_t n)
+{
+#ifdef LPOOL
+	long pos = __atomic_load_n(&c->sent, __ATOMIC_RELAXED);
+	lslot* s;
+	for (;;)
+	{
+		s = &c->slots[pos % c->cap];
+		long d = __atomic_load_n(&s->turn, __ATOMIC_ACQUIRE) - 2 * pos;
+		if (d == 0) {
+			if (__atomic_compare_exchange_n(&c->sent, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (d < 0) {
+			/* Its value from the last lap is not taken yet */
+			return 0;
+		} else {
+			pos = __atomic_load_n(&c->sent, __ATOMIC_RELAXED);
+		}
+	}
+#else
+	long pos = c->sent;
+	lslot* s = &c->slots[pos % c->cap];
+	if (s->turn != 2 * pos) {return 0;}
+	c->sent++;
+#endif
+	s->val = x;
+	s->bytes = n;
+	/* Before it can be taken, which frees the charge */
+	lchan_charge(c, (long)n);
+#ifdef LPOOL
+	__atomic_store_n(&s->turn, 2 * pos + 1, __ATOMIC_RELEASE);
+#else
+	s->turn = 2 * pos + 1;
+#endif
+	return 1;
+}
+
+/* Take the oldest value out of 'c', and the bytes it was charged, unless it is empty */
+int lchan_take(lchan* c, lval** x, size_t* n)
+{
+#ifdef LPOOL
+	long pos = __atomic_load_n(&c->taken, __ATOMIC_RELAXED);
+	lslot* s;
+	for (;;)
+	{
+		s = &c->slots[pos % c->cap];
+		long d = __atomic_load_n(&s->turn, __ATOMIC_ACQUIRE) - (2 * pos + 1);
+		if (d == 0) {
+			if (__atomic_compare_exchange_n(&c->taken, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (d < 0) {
+			/* Nothing was put there this lap yet */
+			return 0;
+		} else {
+			pos = __atomic_load_n(&c->taken, __ATOMIC_RELAXED);
+		}
+	}
+#else
+	long pos = c->taken;
+	lslot* s = &c->slots[pos % c->cap];
+	if (s->turn != 2 * pos + 1) {return 0;}
+	c->taken++;
+#endif
+	*x = s->val;
+	*n = s->bytes;
+	lchan_charge(c, -(long)*n);
+	/* Free for the send of the next lap */
+#ifdef LPOOL
+	__atomic_store_n(&s->turn, 2 * (pos + c->cap), __ATOMIC_RELEASE);
+#else
+	s->turn = 2 * (pos + c->cap);
+#endif
+	return 1;
+}
+
+/* A send of 'val', or a receive into it, on 'chan', and whether that was closed */
+typedef struct lchanop
+{
+	lchan* chan;
+	int send;
+	lval* val;
+	size_t bytes;
+	int closed;
+#ifdef LPOOL
+	lwaitnode node;
+#endif
+} lchanop;
+
+#ifdef LPOOL
+/* Waiters for what 'op' waits for */
+lwaitq* lchanop_queue(lchanop* op)
+{
+	return op->send ? &op->chan->senders : &op->chan->receivers;
+}
+
+/*
+ * Wake the first waiter of 'q', if there is one. The fence pairs with the
+ * one a waiter makes between going on the queue and trying again: either
+ * it sees the change just made, or this sees it on the queue.
+ */
+void lchan_notify(lchan* c, lwaitq* q)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->count, __ATOMIC_RELAXED) == 0) {return;}
+	pthread_mutex_lock(&c->lock);
+	if (q->head) {lwaiter_wake(lwaitq_pop(q));}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void lchanop_wait(lchanop* op, lwaiter* w)
+{
+	lwaitq* q = lchanop_queue(op);
+	pthread_mutex_lock(&op->chan->lock);
+	lwaitq_push(q, &op->node, w);
+	pthread_mutex_unlock(&op->chan->lock);
+}
+
+/* Stop waiting for 'op'; if it was woken and 'pass', the wake goes to another waiter */
+void lchanop_unwait(lchanop* op, int pass)
+{
+	lwaitq* q = lchanop_queue(op);
+	pthread_mutex_lock(&op->chan->lock);
+	if (!lwaitq_remove(q, &op->node) && pass && q->head) {lwaiter_wake(lwaitq_pop(q));}
+	pthread_mutex_unlock(&op->chan->lock);
+}
+#endif
+
+int lchan_closed(lchan* c)
+{
+#ifdef LPOOL
+	return __atomic_load_n(&c->closed, __ATOMIC_SEQ_CST);
+#else
+	return c->closed;
+#endif
+}
+
+/*
+ * Do 'op' unless it would have to wait, then wake a waiter it made room
+ * or a value for. Finding the channel closed is done too.
+ */
+int lchanop_try(lchanop* op)
+{
+	lchan* c = op->chan;
+	if (op->send) {
+		if (lchan_closed(c)) {op->closed = 1; return 1;}
+		if (!lchan_put(c, op->val, op->bytes)) {return 0;}
+#ifdef LPOOL
+		lchan_notify(c, &c->receivers);
+#endif
+	} else {
+		if (!lchan_take(c, &op->val, &op->bytes)) {
+			if (!lchan_closed(c)) {return 0;}
+			/* Values sent before it was closed show by now */
+			if (!lchan_take(c, &op->val, &op->bytes)) {op->closed = 1; return 1;}
+		}
+#ifdef LPOOL
+		lchan_notify(c, &c->senders);
+#endif
+	}
+	return 1;
+}
+
+/*
+ * Do the first of the 'n' operations 'ops' that can go ahead, waiting
+ * until one can. Its index, or -1 if the evaluation has to stop first,
+ * which without a pool is when none can go ahead now.
+ */
+long lchan_select(lchanop* ops, long n)
+{
+	for (long i = 0; i < n; i++)
+	{
+		if (lchanop_try(&ops[i])) {return i;}
+	}
+#ifdef LPOOL
+	lwaiter w;
+	lwaiter_init(&w);
+	long done = -1;
+	int out = 0;
+	while (done < 0 && !out)
+	{
+		/* Trying again once on every queue, so nothing done meanwhile is missed */
+		for (long i = 0; i < n; i++) {lchanop_wait(&ops[i], &w);}
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		for (long i = 0; i < n && done < 0; i++)
+		{
+			if (lchanop_try(&ops[i])) {done = i;}
+		}
+		if (done < 0) {out = lwaiter_sleep(&w);}
+		/* Wakes for the others are not used if it goes now */
+		for (long i = 0; i < n; i++) {lchanop_unwait(&ops[i], (done >= 0 && done != i) || out);}
+	}
+	lwaiter_end(&w);
+	return done;
+#else
+	return -1;
+#endif
+}
+
+/* Give back what the operations in 'ops' but 'done' were to send, or it too if it found its channel closed */
+void lchanop_drop(lchanop* ops, long n, long done)
+{
+	for (long i = 0; i < n; i++)
+	{
+		if (ops[i].send && (i != done || ops[i].closed)) {lval_del(lval_attach(ops[i].val, ops[i].bytes));}
+	}
+}
+
+/* What 'op', which was done, gives: the value received, () for a send, or an error if it was closed */
+lval* lchanop_result(lchanop* op)
+{
+	if (op->closed) {return lval_error(LERR_OTHER, "Channel is closed.");}
+	return op->send ? lval_sexpr() : lval_attach(op->val, op->bytes);
+}
+
+/* The error for a wait that stopped */
+lval* lchan_error(void)
+{
+#ifdef LPOOL
+	return lbudget_error();
+#else
+	return lval_error(LERR_OTHER, "Channel can't be used now and nothing else runs to change that.");
+#endif
+}
+
+/* Close 'c', waking everything that waits on it to see that */
+void lchan_close(lchan* c)
+{
+#ifdef LPOOL
+	__atomic_store_n(&c->closed, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&c->lock);
+	while (c->senders.head) {lwaiter_wake(lwaitq_pop(&c->senders));}
+	while (c->receivers.head) {lwaiter_wake(lwaitq_pop(&c->receivers));}
+	pthread_mutex_unlock(&c->lock);
+#else
+	c->closed = 1;
+#endif
+}
+
+/* Slots a channel can have at most */
+#define LCHAN_MAX (1L << 24)
+
+lchan* lchan_new(long cap)
+{
+	lchan* c = calloc(1, sizeof(lchan));
+	c->holds = 1;
+	c->cap = cap;
+	/* Like the values in it, the ring is charged to the root until the channel goes */
+	c->root = lstate->root;
+	c->slots = lmalloc(sizeof(lslot) * cap);
+	lmem_charge(-(long)lmem_size(c->slots));
+	lchan_charge(c, (long)lmem_size(c->slots));
+	for (long i = 0; i < cap; i++) {c->slots[i].turn = 2 * i;}
+#ifdef LPOOL
+	pthread_mutex_init(&c->lock, NULL);
+#endif
+	return c;
+}
+
+/* The channel to send to through 'v': itself, or the mailbox of an actor */
+lchan* lval_outbox(lval* v)
+{
+	if (v->type == LVAL_CHAN) {return v->chan;}
+	if (v->type == LVAL_FUT) {return v->fut->mailbox;}
+	return NULL;
+}
+
+lval* builtin_chan(lenv* e, lval* a)
+{
+	LASSERT_NUM("chan", a, 1);
+	LASSERT_TYPE("chan", a, 0, LVAL_NUM);
+	long cap = a->cell[0]->num;
+	LASSERT_CODE(a, cap > 0, LERR_RANGE, "Function 'chan' passed size %li, Expected at least 1.", cap);
+	LASSERT_CODE(a, cap <= LCHAN_MAX, LERR_RANGE,
+		"Function 'chan' passed size %li, Expected at most %li.", cap, LCHAN_MAX);
+	lval_del(a);
+	if (!lmem_fits(cap, sizeof(lslot))) {
+		return lval_error(LERR_LIMIT, "memory limit exceeded");
+	}
+
+	lval* v = lmalloc(sizeof(lval));
+	v->type = LVAL_CHAN;
+	v->chan = lchan_new(cap);
+	return v;
+}
+
+lval* builtin_send(lenv* e, lval* a)
+{
+	LASSERT_NUM("send", a, 2);
+	lchan* c = lval_outbox(a->cell[0]);
+	LASSERT_CODE(a, c, LERR_TYPE,
+		"Function 'send' passed incorrect type for argument 0. Got %s, Expected Channel or actor.",
+		ltype_name(a->cell[0]->type));
+	lchanop op = {c, 1};
+	op.val = lval_detach(lval_pop(a, 1), &op.bytes);
+	long done = lchan_select(&op, 1);
+	lchanop_drop(&op, 1, done);
+	lval_del(a);
+	return done < 0 ? lchan_error() : lchanop_result(&op);
+}
+
+lval* builtin_recv(lenv* e, lval* a)
+{
+	LASSERT_NUM("recv", a, 1);
+	LASSERT_TYPE("recv", a, 0, LVAL_CHAN);
+	lchanop op = {a->cell[0]->chan, 0};
+	long done = lchan_select(&op, 1);
+	lval_del(a);
+	return done < 0 ? lchan_error() : lchanop_result(&op);
+}
+
+/* Close a channel, or the mailbox of an actor */
+lval* builtin_close(lenv* e, lval* a)
+{
+	LASSERT_NUM("close", a, 1);
+	lchan* c = lval_outbox(a->cell[0]);
+	LASSERT_CODE(a, c, LERR_TYPE,
+		"Function 'close' passed incorrect type for argument 0. Got %s, Expected Channel or actor.",
+		ltype_name(a->cell[0]->type));
+	lchan_close(c);
+	lval_del(a);
+	return lval_sexpr();
+}
+
+/*
+ * (select c {d x} ...) receives from the channel 'c', or sends 'x' on
+ * 'd', whichever can go first, trying them in order. Gives the index of
+ * the one done and the value received, () for a send. 'd' can be an actor.
+ * If the one it can do is on a closed channel, select is an error.
+ */
+lval* builtin_select(lenv* e, lval* a)
+{
+	LASSERT_CODE(a, a->count > 0, LERR_ARGS, "Function 'select' passed no channels.");
+	for (int i = 0; i < a->count; i++)
+	{
+		lval* x = a->cell[i];
+		LASSERT_CODE(a, x->type == LVAL_CHAN || (x->type == LVAL_QEXPR && x->count == 2
+			&& lval_outbox(x->cell[0])), LERR_TYPE,
+			"Function 'select' passed incorrect type for argument %i. "
+			"Got %s, Expected Channel or {Channel value}.", i, ltype_name(x->type));
+	}
+
+	lchanop* ops = lmalloc(sizeof(lchanop) * a->count);
+	for (int i = 0; i < a->count; i++)
+	{
+		lval* x = a->cell[i];
+		ops[i].send = x->type == LVAL_QEXPR;
+		ops[i].chan = lval_outbox(ops[i].send ? x->cell[0] : x);
+		ops[i].closed = 0;
+		if (ops[i].send) {ops[i].val = lval_detach(lval_pop(x, 1), &ops[i].bytes);}
+	}
+	long done = lchan_select(ops, a->count);
+	lchanop_drop(ops, a->count, done);
+	lval* r = NULL;
+	if (done < 0) {
+		r = lchan_error();
+	} else if (ops[done].closed) {
+		/* An error, as recv and send give, rather than one inside the list */
+		r = lchanop_result(&ops[done]);
+	} else {
+		r = lval_add(lval_add(lval_qexpr(), lval_num(done)), lchanop_result(&ops[done]));
+	}
+	lfree(ops);
 	lval_del(a);
-	return lval_sexpr();
+	return r;
 }
 
-lval* builtin_add(lenv* e, lval* a)
+/* Actors */
+/*
+ * (actor f init) starts an actor: a green thread, or else a future that
+ * keeps a worker to itself, with an interpreter and so a heap of its own
+ * that nothing else reaches into. Its state starts as 'init', and each message sent to it
+ * makes the state (f state message), one after another. Messages move
+ * in as values sent on a channel do, without a copy where they can, and
+ * the mailbox holds LACTOR_MAILBOX of them before senders wait. Each
+ * message is evaluated with its own budget. An error ends the actor,
+ * and nothing else; whatever is left in the mailbox is dropped and later
+ * sends fail. Once nobody holds the actor, or it is closed, it handles
+ * what was sent and ends, and await gives its last state.
+ */
+#define LACTOR_MAILBOX 256
+
+/* Handle the messages of the actor 'f', in its interpreter */
+void lactor_run(lfuture* f)
 {
-	return builtin_op(e, a, "+");
+	lval* x = f->expr;
+	f->expr = NULL;
+	lval* fun = lval_pop(x, 0);
+	lval* st = lval_take(x, 0);
+	while (st->type != LVAL_ERR)
+	{
+		lchanop op = {f->mailbox, 0};
+		/* Waiting for mail only stops for a cancel, not the last message's deadline */
+		lstate->budget_end = 0;
+		if (lchan_select(&op, 1) < 0) {
+			lval_del(st);
+			st = lchan_error();
+		} else if (op.closed) {
+			break;
+		} else {
+			lbudget_begin();
+			st = lval_call2(f->env, fun, st, lval_attach(op.val, op.bytes));
+			lbudget_end();
+		}
+	}
+	lchan_close(f->mailbox);
+	lval_del(fun);
+	f->result = st;
 }
 
-lval* builtin_sub(lenv* e, lval* a)
+lval* builtin_actor(lenv* e, lval* a)
 {
-	return builtin_op(e, a, "-");
+	LASSERT_NUM("actor", a, 2);
+	LASSERT_TYPE("actor", a, 0, LVAL_FUN);
+#ifdef LPOOL
+#ifdef LGREEN
+	lpool* p = lpool_green();
+	int green = p != NULL;
+#else
+	lpool* p = lpool_get();
+	int green = 0;
+#endif
+	LASSERT(a, p, "Function 'actor' needs a pool of worker threads.");
+	/* The function and first state go over the way a spawned expression does */
+	a->type = LVAL_QEXPR;
+	lfuture* f = lfuture_new(e, a);
+	lval_del(a);
+	f->mailbox = lchan_new(LACTOR_MAILBOX);
+#ifdef LGREEN
+	if (green) {lgreen_start(p, f);}
+#endif
+	if (!green) {lfuture_start(p, f);}
+	return lval_future(f);
+#else
+	lval_del(a);
+	return lval_error(LERR_OTHER, "Function 'actor' needs a pool of worker threads.");
+#endif
 }
 
-lval* builtin_mul(lenv* e, lval* a)
+/* Parallel Functions */
+lval* builtin_pmap(lenv* e, lval* a)
 {
-	return builtin_op(e, a, "*");
+	LASSERT_NUM("pmap", a, 2);
+	LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+	LASSERT_LIST("pmap", a, 1);
+	a = lval_force(e, a, 1);
+	if (a->cell[1]->type == LVAL_ERR) {return lval_take(a, 1);}
+
+#ifdef LPOOL
+	lpool* p = a->cell[1]->count > 1 ? lpool_get() : NULL;
+	if (p) {
+		lgroup g;
+		lval* l = a->cell[1];
+		lpool_run(p, &g, lpmap_run, e, a->cell[0], l, 1);
+		lval* err = g.failed == LONG_MAX && !g.cancel ? NULL : lgroup_end(&g);
+		if (err) {lval_del(a); return err;}
+
+		/* Bring the results over in order, in place of the elements */
+		for (long i = 0; i < l->count; i++)
+		{
+			lval_del(l->cell[i]);
+			l->cell[i] = lval_export(g.out[i]);
+			lgroup_drop(&g, i);
+		}
+		lgroup_end(&g);
+		return lval_take(a, 1);
+	}
+#endif
+	/* Without a pool it is map */
+	return builtin_map(e, a);
 }
 
-lval* builtin_div(lenv* e, lval* a)
+/* Lists shorter than this are reduced in order, and chunks are at least a quarter of it */
+#define LPREDUCE_MIN 64
+/* Chunks a long list is cut into, at most */
+#define LPREDUCE_PARTS 256
+
+/*
+ * Reduce a list with an associative function: chunks are folded on the
+ * pool, then neighbouring partial results are combined in pairs, a level
+ * of the tree at a time, and the initial value goes in front once. The
+ * chunks only depend on the length of the list, so the order the
+ * function is applied in is the same whatever the number of threads.
+ */
+lval* builtin_preduce(lenv* e, lval* a)
 {
-	return builtin_op(e, a, "/");
+	LASSERT_NUM("preduce", a, 3);
+	LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+	LASSERT_LIST("preduce", a, 2);
+	a = lval_force(e, a, 2);
+	if (a->cell[2]->type == LVAL_ERR) {return lval_take(a, 2);}
+
+#ifdef LPOOL
+	lpool* p = a->cell[2]->count >= LPREDUCE_MIN ? lpool_get() : NULL;
+	if (p) {
+		lval* l = lval_pop(a, 2);
+		long width = (l->count + LPREDUCE_PARTS - 1) / LPREDUCE_PARTS;
+		if (width < LPREDUCE_MIN / 4) {width = LPREDUCE_MIN / 4;}
+		while (l->count > 1)
+		{
+			lgroup g;
+			lpool_run(p, &g, lpreduce_run, e, a->cell[0], l, width);
+			lval* next = NULL;
+			if (g.failed == LONG_MAX && !g.cancel) {
+				next = lval_qexpr();
+				for (long i = 0; i < g.count; i++)
+				{
+					next = lval_add(next, lval_export(g.out[i]));
+					lgroup_drop(&g, i);
+				}
+			}
+			lval* err = lgroup_end(&g);
+			lval_del(l);
+			if (err) {lval_del(a); return err;}
+			l = next;
+			width = 2;
+		}
+		lval* init = a->cell[1];
+		a->cell[1] = lval_sexpr();
+		lval* r = lval_call2(e, a->cell[0], init, lval_take(l, 0));
+		lval_del(a);
+		return r;
+	}
+#endif
+	/* Without a pool, or for a short list, it is foldl */
+	return builtin_fold(e, a, "foldl");
 }
 
-lval* builtin_def(lenv* e, lval* a)
+#ifdef LPOOL
+/*
+ * par evaluates the arguments of a call on the pool at the same time,
+ * where that can't be told from evaluating them in order. Each argument
+ * is evaluated with copies of the bindings, so everything the call can
+ * reach has to be pure: no 'def' or '=', nothing that waits or sends,
+ * and no builtin of the embedder's. Only the arguments that call
+ * functions are worth sending off, the rest are evaluated here.
+ */
+/* Symbols and expressions looked at before a call is taken to be impure */
+#define LPAR_NODES 10000
+/* Lambdas followed, at most */
+#define LPAR_FUNS 64
+/* Weight of calling a lambda, or a builtin that calls one */
+#define LPAR_CALL 64
+/* Arguments lighter than this are evaluated in place */
+#define LPAR_MIN LPAR_CALL
+
+struct lpar;
+typedef struct lpar lpar;
+struct lpar
 {
-	return builtin_var(e, a, "def");
-}
+	lenv* e;
+	long nodes;
+	int nfuns;
+	/* Lambdas already followed, so recursion ends */
+	lval* funs[LPAR_FUNS];
+};
 
-lval* builtin_put(lenv* e, lval* a)
+/* Builtins that call the functions they are given */
+int lpar_calls(lbuiltin f)
 {
-	return builtin_var(e, a, "=");
+	return f == builtin_eval || f == builtin_map
+		|| f == builtin_filter || f == builtin_foldl
+		|| f == builtin_foldr || f == builtin_collect
+		|| f == builtin_pmap || f == builtin_preduce
+		|| f == builtin_par;
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func)
+/* Builtins with no effect but their result, for pure arguments */
+int lpar_builtin(lbuiltin f)
 {
-	lval* k = lval_sym(name);
-	lval* v = lval_fun(func);
-	lenv_put(e, k, v);
-	lval_del(k); lval_del(v);
+	return lbuiltin_pure(f) || lpar_calls(f)
+		|| f == builtin_if || f == builtin_lambda
+		|| f == builtin_range || f == builtin_error
+		|| f == builtin_try || f == builtin_lazy_range
+		|| f == builtin_iterate || f == builtin_take;
 }
 
-void lenv_add_builtins(lenv* e)
+/* Value of symbol 's' where the call is made, or NULL */
+lval* lpar_get(lpar* p, char* s)
 {
-	/* List Functions */
-	lenv_add_builtin(e, "list", builtin_list);
-	lenv_add_builtin(e, "head", builtin_head);
-	lenv_add_builtin(e, "tail", builtin_tail);
-	lenv_add_builtin(e, "eval", builtin_eval);
-	lenv_add_builtin(e, "join", builtin_join);
+	lval* x = NULL;
+	for (lenv* t = p->e; t && !x; t = t->par) {x = lenv_peek(t, s);}
+	return x;
+}
 
-	/* Mathematical Functions */
-	lenv_add_builtin(e, "+", builtin_add);
-	lenv_add_builtin(e, "-", builtin_sub);
-	lenv_add_builtin(e, "*", builtin_mul);
-	lenv_add_builtin(e, "/", builtin_div);
+int lpar_pure(lpar* p, lval* v);
 
-	/* Variable Functions */
-	lenv_add_builtin(e, "\\", builtin_lambda);
-	lenv_add_builtin(e, "def", builtin_def);
-	lenv_add_builtin(e, "=", builtin_put);
+/* Whether calling 'f' can only make a result */
+int lpar_pure_fun(lpar* p, lval* f)
+{
+	if (f->memo) {return lpar_pure_fun(p, f->memo->fun);}
+	if (f->builtin) {return lpar_builtin(f->builtin);}
+	for (int i = 0; i < p->nfuns; i++)
+	{
+		if (p->funs[i] == f) {return 1;}
+	}
+	if (p->nfuns == LPAR_FUNS) {return 0;}
+	p->funs[p->nfuns++] = f;
+	for (int i = 0; i < f->env->count; i++)
+	{
+		if (!lpar_pure(p, f->env->vals[i])) {return 0;}
+	}
+	return lpar_pure(p, f->body);
 }
 
-/* Eval */
-lval* lval_eval_sexpr(lenv* e, lval* v) 
+/*
+ * Whether evaluating 'v' can only make a result. Code can be quoted and
+ * evaluated later, so every symbol in it counts, quoted or not, along
+ * with what it is bound to. Unbound symbols are formals of the lambdas.
+ */
+int lpar_pure(lpar* p, lval* v)
 {
-	/* eval children */
-	for (int i = 0; i < v->count; i++)
+	switch (v->type)
 	{
-		v->cell[i] = lval_eval(e, v->cell[i]);
+		case LVAL_NUM: case LVAL_ERR: return 1;
+		case LVAL_FUT: case LVAL_CHAN: return 1;
+		case LVAL_SEQ: return 0;
+		case LVAL_FUN: return lpar_pure_fun(p, v);
+	}
+	if (++p->nodes > LPAR_NODES) {return 0;}
+	if (v->type == LVAL_SYM) {
+		lval* x = lpar_get(p, v->sym);
+		return !x || lpar_pure(p, x);
 	}
-	/* error checking */
 	for (int i = 0; i < v->count; i++)
 	{
-		if (v->cell[i]->type == LVAL_ERR) {return lval_take(v, i);}
+		if (!lpar_pure(p, v->cell[i])) {return 0;}
 	}
-	/* empty expression */
-	if (v->count == 0) {return v;}
-	/* single expression */
-	if (v->count == 1) {return lval_take(v, 0);}
-	/* ensure first element is a function after evaluation */
-	lval* f = lval_pop(v, 0);
-	if (f->type != LVAL_FUN) {
-		lval* err = lval_err(
-			"S-Expression starts with incorrect type. "
-			"Got %s, Expected %s.",
-			ltype_name(f->type), ltype_name(LVAL_FUN));
-		lval_del(f); lval_del(v);
-		return err;
+	return 1;
+}
+
+/*
+ * Rough cost of evaluating 'v': calls to lambdas are what weigh. The
+ * branches of 'if' and the like are quoted, so Q-Expressions count too.
+ */
+long lpar_weight(lpar* p, lval* v)
+{
+	if ((v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) || v->count == 0) {return 0;}
+	long w = 1;
+	lval* f = v->cell[0]->type == LVAL_SYM ? lpar_get(p, v->cell[0]->sym) : NULL;
+	if (v->cell[0]->type == LVAL_SEXPR
+		|| (f && f->type == LVAL_FUN && (!f->builtin || lpar_calls(f->builtin)))) {
+		w += LPAR_CALL;
 	}
-	/* if so call function to get result */
-	lval* result = lval_call(e, f, v);
-	lval_del(f);
-	return result;
+	for (int i = 0; i < v->count && w < LPAR_MIN; i++) {w += lpar_weight(p, v->cell[i]);}
+	return w;
 }
 
-lval* lval_eval(lenv* e, lval* v)
+/*
+ * Evaluate the call 'v' with its heavy arguments on the pool, or return
+ * NULL if it isn't pure or has fewer than two of them. Errors are those
+ * evaluating in order would give, the first by position.
+ */
+lval* lpar_eval(lpool* p, lenv* e, lval* v)
 {
-	/* evaluate sexpressions */
-	if (v->type == LVAL_SYM) {
-		lval* x = lenv_get(e, v);
+	lpar a = {e, 0, 0, {NULL}};
+	if (!lpar_pure(&a, v)) {return NULL;}
+	char* heavy = lcalloc(v->count, 1);
+	long n = 0;
+	for (int i = 1; i < v->count; i++)
+	{
+		heavy[i] = lpar_weight(&a, v->cell[i]) >= LPAR_MIN;
+		n += heavy[i];
+	}
+	if (n < 2) {lfree(heavy); return NULL;}
+
+	lval* l = lval_qexpr();
+	for (int i = 1; i < v->count; i++)
+	{
+		if (!heavy[i]) {continue;}
+		l = lval_add(l, v->cell[i]);
+		v->cell[i] = lval_sexpr();
+	}
+	lgroup g;
+	lpool_run(p, &g, lpar_run, e, v->cell[0], l, 1);
+	lval_del(l);
+
+	/* The rest in order, up to the first argument that failed */
+	lval* err = NULL;
+	for (long i = 0, k = 0; i < v->count && !g.cancel; i++)
+	{
+		if (heavy[i]) {
+			if (k++ == g.failed) {break;}
+			continue;
+		}
+		v->cell[i] = lval_eval(e, v->cell[i]);
+		if (v->cell[i]->type == LVAL_ERR) {
+			err = v->cell[i];
+			v->cell[i] = lval_sexpr();
+			break;
+		}
+	}
+	if (err || g.failed != LONG_MAX || g.cancel) {
+		lval* r = lgroup_end(&g);
+		if (err) {
+			if (r) {lval_del(r);}
+			r = err;
+		}
+		lfree(heavy);
 		lval_del(v);
-		return x;
+		return r;
 	}
-	if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-	return v;
+
+	for (long i = 0, k = 0; i < v->count; i++)
+	{
+		if (!heavy[i]) {continue;}
+		lval_del(v->cell[i]);
+		v->cell[i] = lval_export(g.out[k]);
+		lgroup_drop(&g, k++);
+	}
+	lgroup_end(&g);
+	lfree(heavy);
+	return lval_call_sexpr(e, v);
 }
+#endif
 
-/* Read */
-lval* lval_read_num(mpc_ast_t* t)
+/* Evaluate a call with its arguments at the same time where it is safe to */
+lval* builtin_par(lenv* e, lval* a)
 {
-	errno = 0; 
-	long x = strtol(t->contents, NULL, 10);
-	return errno != ERANGE ?
-		lval_num(x) : lval_err("invalid numuber");
+	LASSERT_NUM("par", a, 1);
+	LASSERT_TYPE("par", a, 0, LVAL_QEXPR);
+
+	lval* v = lval_take(a, 0);
+	v->type = LVAL_SEXPR;
+#ifdef LPOOL
+	lpool* p = v->count > 2 ? lpool_get() : NULL;
+	lval* r = p ? lpar_eval(p, e, v) : NULL;
+	if (r) {return r;}
+#endif
+	/* Otherwise it is evaluated as it is */
+	return lval_eval(e, v);
 }
 
-lval* lval_read(mpc_ast_t* t)
+/* Interpreter state */
+/* A fresh interpreter, with its grammar and builtins */
+tlisp_state_t* tlisp_state_new(void)
 {
-	/* if symbol or number return conversion to that type */
-	if (strstr(t->tag, "number")) {return lval_read_num(t);}
-	if (strstr(t->tag, "symbol")) {return lval_sym(t->contents);}
+	tlisp_state_t* s = calloc(1, sizeof(tlisp_state_t));
+#ifdef __GNUC__
+	s->lvm_mode = LVM_THREADED;
+#else
+	s->lvm_mode = LVM_SWITCH;
+#endif
+	s->lvm_jit_on = 1;
+	s->opt_inline_size = 16;
+	s->budget_tick = LONG_MAX;
+	s->root = s;
 
-	/* if root (>) or sexpr then creat empty list */
-	lval* x = NULL;
-	if (strcmp(t->tag, ">") == 0) {x = lval_sexpr();}
-	if (strstr(t->tag, "sexpr"))  {x = lval_sexpr();}
-	if (strstr(t->tag, "qexpr"))  {x = lval_qexpr();}
+	/* create some parsers */
+	s->number	= mpc_new("number");
+	s->symbol	= mpc_new("symbol");
+	s->sexpr	= mpc_new("sexpr");
+	s->qexpr	= mpc_new("qexpr");
+	s->expr		= mpc_new("expr");
+	s->tlisp	= mpc_new("tlisp");
 
-	for (int i = 0; i < t->children_num; i++)
-	{
-		if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-		if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-		if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-		if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-		if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-		x = lval_add(x, lval_read(t->children[i]));
+	/* define them with the following language */
+	mpca_lang(MPCA_LANG_DEFAULT,									
+		"															\
+			number	: /-?[0-9]+/ ;									\
+	    	symbol	: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;			\
+			sexpr	: '(' <expr>* ')' ;								\
+			qexpr	: '{' <expr>* '}' ;								\
+			expr	: <number> | <symbol> | <sexpr> | <qexpr> ;		\
+			tlisp	: /^/ <expr>* /$/ ;								\
+		", s->number, s->symbol, s->sexpr, s->qexpr, s->expr, s->tlisp);
+
+	/* the environment is charged to the new interpreter */
+	tlisp_state_t* prev = tlisp_enter(s);
+	s->env = lenv_new();
+	tlisp_enter(prev);
+	return s;
+}
+
+void tlisp_state_del(tlisp_state_t* s)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	lenv_del(s->env);
+	tlisp_enter(prev == s ? NULL : prev);
+	/* after the globals, which cancels the futures left in them */
+	if (s->pool) {lpool_del(s->pool);}
+
+	/* workers have no grammar, and use the natives of their owner */
+	if (!s->owner) {
+		mpc_cleanup(6, s->number, s->symbol, s->sexpr, s->qexpr, s->expr, s->tlisp);
+		free(s->natives);
 	}
-	return x;
+	free(s->lvm_stack);
+	free(s->lvm_frames);
+#ifdef LVM_JIT
+	if (s->ljit_enter) {
+		munmap((void*)s->ljit_enter, s->ljit_size);
+		munmap(s->ljit_stack, LJIT_STACK);
+	}
+#endif
+	free(s);
 }
 
-lval* builtin_lambda(lenv* e, lval* a)
+/* Make 's' the interpreter of the calling thread, and return the last one */
+tlisp_state_t* tlisp_enter(tlisp_state_t* s)
 {
-	/* Check two args, each of which are Q-Expr */
-	LASSERT_NUM("\\", a, 2);
-	LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-	LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+	tlisp_state_t* prev = lstate;
+	lstate = s;
+	return prev;
+}
 
-	/* Check first Q-Expr contains only Symbols */
-	for (int i = 0; i < a->cell[0]->count; i++)
-	{
-		LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-			"Cannot define non-symbol. Got %s, Expected %s.",
-			ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+/* C API */
+int tlisp_set(tlisp_state_t* s, int option, long value)
+{
+	switch (option) {
+		case TLISP_OPT_VM:
+			if (value < TLISP_VM_OFF || value > TLISP_VM_THREADED) {return 0;}
+#ifndef __GNUC__
+			if (value == TLISP_VM_THREADED) {value = TLISP_VM_SWITCH;}
+#endif
+			s->lvm_mode = value; return 1;
+		case TLISP_OPT_JIT: s->lvm_jit_on = value != 0; return 1;
+		case TLISP_OPT_DUMP_OPT: s->opt_dump = value != 0; return 1;
+		case TLISP_OPT_INLINE_SIZE: s->opt_inline_size = value; return 1;
+		case TLISP_OPT_FUEL: s->budget_fuel = value; return 1;
+		case TLISP_OPT_DEADLINE: s->budget_ms = value; return 1;
+		case TLISP_OPT_MEM_LIMIT: s->mem_limit = value; return 1;
+		case TLISP_OPT_THREADS:
+			if (value < 0) {return 0;}
+			/* the pool is started again at the new size when next needed */
+			if (s->pool) {lpool_del(s->pool); s->pool = NULL;}
+			s->pool_size = value; return 1;
 	}
+	return 0;
+}
 
-	/* Pop first 2 args and pass them to lval_lambda */
-	lval* formals = lval_pop(a, 0);
-	lval* body = lval_pop(a, 0);
-	lval_del(a);
+int tlisp_register(tlisp_state_t* s, const char* name, tlisp_builtin fn, void* data)
+{
+	lnative* natives = realloc(s->natives, sizeof(lnative) * (s->nnatives + 1));
+	if (!natives) {return 0;}
+	s->natives = natives;
+	s->natives[s->nnatives].fn = fn;
+	s->natives[s->nnatives].data = data;
 
-	return lval_lambda(formals, body);
+	tlisp_state_t* prev = tlisp_enter(s);
+	lval* k = lval_sym((char*)name);
+	lval* v = lval_fun(builtin_native);
+	v->num = s->nnatives++;
+	lenv_put(s->env, k, v);
+	lval_del(k); lval_del(v);
+	tlisp_enter(prev);
+	return 1;
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a)
+tlisp_value_t* tlisp_eval(tlisp_state_t* s, const char* src)
 {
-	/* if Builtin then simply call that */
-	if (f->builtin) {return f->builtin(e, a);}
+	return tlisp_eval_buffer(s, "<string>", src, strlen(src));
+}
 
-	/* Record Argument Counts */
-	int given = a->count;
-	int total = f->formals->count;
+tlisp_value_t* tlisp_eval_buffer(tlisp_state_t* s, const char* name,
+	const char* buf, size_t len)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	/* the grammar reads up to a NUL, the copy isn't charged to the program */
+	char* input = malloc(len + 1);
+	memcpy(input, buf, len);
+	input[len] = '\0';
 
-	/* While arguments still remain to be processed */
-	while (a->count) {
-		/* If we've ran out of formal arguments to bind */
-		if (f->formals->count == 0) {
-			lval_del(a); return lval_err(
-					"Function passed too many arguments. "
-					"Got %i, Expected %i.", given, total);
-		}
-		/* Pop the first symbol from the formals */
-		lval* sym = lval_pop(f->formals, 0);
-		/* Pop the next argument from the list */
-		lval* val = lval_pop(a, 0);
-		/* Bind a copy into the function's environment */
-		lenv_put(f->env, sym, val);
-		/* Delete symbol and value */
-		lval_del(sym); lval_del(val);
-	}
-	/* Argument list is now bound so can be cleaned up */
-	lval_del(a);
-	/* If all formals have been bound evaluate */
-	if (f->formals->count == 0) {
-		/* Set the parent environment */
-		f->env->par = e;
-		/* Evaluate the body */
-		return builtin_eval(
-				f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+	lval* x;
+	mpc_result_t r;
+	/* Workers parse with the grammar of the root, which parsing only reads */
+	if (mpc_parse(name, input, s->root->tlisp, &r)) {
+		/* Called by a native, it goes on with the budget of the evaluation it is part of */
+		int nested = prev == s;
+		if (!nested) {lbudget_begin();}
+		x = lval_eval(s->env, lval_read(r.output));
+		if (!nested) {lbudget_end();}
+		mpc_ast_delete(r.output);
 	} else {
-		/* Otherwise return partially evaluated function */
-		return lval_copy(f);
+		char* msg = mpc_err_string(r.error);
+		x = lval_error(LERR_PARSE, "%s", msg);
+		free(msg);
+		mpc_err_delete(r.error);
 	}
+	free(input);
+	tlisp_enter(prev);
+	return x;
+}
+
+int tlisp_interrupt(tlisp_state_t* s)
+{
+	if (!s->budget_busy) {return 0;}
+	s->budget_interrupt = 1;
+	return 1;
+}
+
+int tlisp_type(const tlisp_value_t* v) {return v->type;}
+const char* tlisp_type_name(int type) {return ltype_name(type);}
+long tlisp_num(const tlisp_value_t* v) {return v->num;}
+const char* tlisp_sym(const tlisp_value_t* v) {return v->sym;}
+int tlisp_count(const tlisp_value_t* v) {return v->count;}
+tlisp_value_t* tlisp_cell(const tlisp_value_t* v, int i) {return v->cell[i];}
+int tlisp_error_code(const tlisp_value_t* v) {return v->err->code;}
+
+const char* tlisp_error_msg(tlisp_state_t* s, tlisp_value_t* v)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	char* msg = lerr_msg(v->err);
+	tlisp_enter(prev);
+	return msg;
+}
+
+void tlisp_println(tlisp_state_t* s, tlisp_value_t* v)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	lval_println(v);
+	tlisp_enter(prev);
+}
+
+tlisp_value_t* tlisp_make_num(tlisp_state_t* s, long x)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	lval* v = lval_num(x);
+	tlisp_enter(prev);
+	return v;
+}
+
+tlisp_value_t* tlisp_make_sym(tlisp_state_t* s, const char* sym)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	lval* v = lval_sym((char*)sym);
+	tlisp_enter(prev);
+	return v;
+}
+
+tlisp_value_t* tlisp_make_error(tlisp_state_t* s, const char* msg)
+{
+	return tlisp_make_error_code(s, LERR_USER, msg);
+}
+
+tlisp_value_t* tlisp_make_error_code(tlisp_state_t* s, int code, const char* msg)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	lval* v = lval_error(code, "%s", msg);
+	tlisp_enter(prev);
+	return v;
+}
+
+tlisp_value_t* tlisp_make_list(tlisp_state_t* s)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	lval* v = lval_qexpr();
+	tlisp_enter(prev);
+	return v;
+}
+
+tlisp_value_t* tlisp_make_sexpr(tlisp_state_t* s)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	lval* v = lval_sexpr();
+	tlisp_enter(prev);
+	return v;
+}
+
+tlisp_value_t* tlisp_list_add(tlisp_state_t* s, tlisp_value_t* list, tlisp_value_t* v)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	lval_add(list, v);
+	tlisp_enter(prev);
+	return list;
+}
+
+tlisp_value_t* tlisp_list_pop(tlisp_state_t* s, tlisp_value_t* list, int i)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	lval* x = lval_pop(list, i);
+	tlisp_enter(prev);
+	return x;
+}
+
+tlisp_value_t* tlisp_copy(tlisp_state_t* s, const tlisp_value_t* v)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	lval* x = lval_copy((lval*)v);
+	tlisp_enter(prev);
+	return x;
 }
 
+void tlisp_free(tlisp_state_t* s, tlisp_value_t* v)
+{
+	tlisp_state_t* prev = tlisp_enter(s);
+	lval_del(v);
+	tlisp_enter(prev);
+}
@@ -0,0 +1,129 @@
+#ifndef tlisp_h
+#define tlisp_h
+
+/*
+ * Embedding API of the tlisp interpreter (libtlisp).
+ *
+ * Each interpreter is a tlisp_state_t with its own globals, heap and
+ * settings. Interpreters are independent: several can be used from one
+ * thread, or each from its own thread, but one interpreter must not be
+ * used by two threads at once.
+ *
+ * Values returned by the API belong to the caller and are released with
+ * tlisp_free, passing the interpreter that made them.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__) && !defined(_WIN32)
+#define TLISP_API __attribute__((visibility("default")))
+#else
+#define TLISP_API
+#endif
+
+typedef struct tlisp_state tlisp_state_t;
+typedef struct lval tlisp_value_t;
+
+/* Types of values */
+enum {TLISP_ERROR, TLISP_NUMBER, TLISP_SYMBOL, TLISP_FUNCTION,
+	TLISP_SEXPR, TLISP_QEXPR, TLISP_SEQUENCE, TLISP_FUTURE, TLISP_CHANNEL};
+
+/* Kinds of errors */
+enum {TLISP_ERR_OTHER, TLISP_ERR_UNBOUND, TLISP_ERR_TYPE, TLISP_ERR_ARGS,
+	TLISP_ERR_EMPTY, TLISP_ERR_RANGE, TLISP_ERR_DIV_ZERO, TLISP_ERR_OVERFLOW,
+	TLISP_ERR_NUMBER, TLISP_ERR_USER, TLISP_ERR_LIMIT, TLISP_ERR_INTERRUPT,
+	TLISP_ERR_PARSE};
+
+/* Settings, for tlisp_set */
+enum {
+	/* TLISP_VM_OFF, TLISP_VM_SWITCH or TLISP_VM_THREADED */
+	TLISP_OPT_VM,
+	/* Compile hot code to native code, 0 or 1 */
+	TLISP_OPT_JIT,
+	/* Print lambda bodies after optimization, 0 or 1 */
+	TLISP_OPT_DUMP_OPT,
+	/* Largest body, in nodes, inlined into callers */
+	TLISP_OPT_INLINE_SIZE,
+	/* Steps, milliseconds and bytes each evaluation may use, 0 for no limit */
+	TLISP_OPT_FUEL,
+	TLISP_OPT_DEADLINE,
+	TLISP_OPT_MEM_LIMIT,
+	/*
+	 * Threads of the pool behind pmap, spawn and the other parallel
+	 * builtins, 0 for one per processor. With 1 those run on the calling
+	 * thread, but green threads still get a worker of their own.
+	 */
+	TLISP_OPT_THREADS
+};
+enum {TLISP_VM_OFF, TLISP_VM_SWITCH, TLISP_VM_THREADED};
+
+/*
+ * A native builtin. It owns 'args', a list of the evaluated arguments,
+ * and returns a new value, or an error made with tlisp_make_error.
+ *
+ * 's' is the interpreter that calls it: the one it was registered with,
+ * or one evaluating for it on a worker thread, for pmap, spawn and the
+ * like, which has its own copy of the globals. So a native may run on
+ * several threads at once and must be thread-safe; it makes its values
+ * with 's', and may evaluate with 's' but not with any other interpreter.
+ */
+typedef tlisp_value_t* (*tlisp_builtin)(tlisp_state_t* s, tlisp_value_t* args, void* data);
+
+/* Interpreters */
+TLISP_API tlisp_state_t* tlisp_state_new(void);
+TLISP_API void tlisp_state_del(tlisp_state_t* s);
+/* Change a setting, returning 0 for an unknown one */
+TLISP_API int tlisp_set(tlisp_state_t* s, int option, long value);
+/* Bind 'name' in the global environment to a native builtin, returning 0 when out of memory */
+TLISP_API int tlisp_register(tlisp_state_t* s, const char* name, tlisp_builtin fn, void* data);
+
+/*
+ * Evaluate source text as the REPL evaluates a line. Called by a native
+ * with the interpreter it was given, it is part of the evaluation that
+ * called the native, and shares its budget.
+ */
+TLISP_API tlisp_value_t* tlisp_eval(tlisp_state_t* s, const char* src);
+TLISP_API tlisp_value_t* tlisp_eval_buffer(tlisp_state_t* s, const char* name,
+	const char* buf, size_t len);
+/*
+ * Stop the running evaluation of 's' with TLISP_ERR_INTERRUPT, returning
+ * 0 if none runs. Safe to call from a signal handler or another thread.
+ */
+TLISP_API int tlisp_interrupt(tlisp_state_t* s);
+
+/* Inspecting values */
+TLISP_API int tlisp_type(const tlisp_value_t* v);
+TLISP_API const char* tlisp_type_name(int type);
+TLISP_API long tlisp_num(const tlisp_value_t* v);
+TLISP_API const char* tlisp_sym(const tlisp_value_t* v);
+/* Elements of an S-Expression or Q-Expression, borrowed from 'v' */
+TLISP_API int tlisp_count(const tlisp_value_t* v);
+TLISP_API tlisp_value_t* tlisp_cell(const tlisp_value_t* v, int i);
+TLISP_API int tlisp_error_code(const tlisp_value_t* v);
+TLISP_API const char* tlisp_error_msg(tlisp_state_t* s, tlisp_value_t* v);
+/* Print 'v' to stdout as the REPL does, followed by a newline */
+TLISP_API void tlisp_println(tlisp_state_t* s, tlisp_value_t* v);
+
+/* Making and releasing values */
+TLISP_API tlisp_value_t* tlisp_make_num(tlisp_state_t* s, long x);
+TLISP_API tlisp_value_t* tlisp_make_sym(tlisp_state_t* s, const char* sym);
+TLISP_API tlisp_value_t* tlisp_make_error(tlisp_state_t* s, const char* msg);
+TLISP_API tlisp_value_t* tlisp_make_error_code(tlisp_state_t* s, int code, const char* msg);
+/* An empty Q-Expression or S-Expression, and 'list' with 'v' added to its end */
+TLISP_API tlisp_value_t* tlisp_make_list(tlisp_state_t* s);
+TLISP_API tlisp_value_t* tlisp_make_sexpr(tlisp_state_t* s);
+TLISP_API tlisp_value_t* tlisp_list_add(tlisp_state_t* s, tlisp_value_t* list, tlisp_value_t* v);
+/* Take element 'i' out of 'list', handing it to the caller */
+TLISP_API tlisp_value_t* tlisp_list_pop(tlisp_state_t* s, tlisp_value_t* list, int i);
+TLISP_API tlisp_value_t* tlisp_copy(tlisp_state_t* s, const tlisp_value_t* v);
+TLISP_API void tlisp_free(tlisp_state_t* s, tlisp_value_t* v);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
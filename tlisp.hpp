@@ -0,0 +1,359 @@
+#ifndef tlisp_hpp
+#define tlisp_hpp
+
+/*
+ * Header-only C++17 layer over tlisp.h.
+ *
+ * tlisp::Value owns one value and frees it when it goes out of scope.
+ * It can be moved but not copied, so ownership passes along without
+ * deep copies; clone() makes a copy where one is really wanted.
+ * tlisp::View borrows a value, such as an element of a list.
+ * Values have to be gone before the Interpreter that made them.
+ *
+ * tlisp::Interpreter::def registers any C++ callable as a builtin. The
+ * argument count and types it expects are worked out from the
+ * callable's signature at compile time, and an unsupported parameter or
+ * return type fails to compile. Parameters can be integers (Numbers),
+ * std::string (Symbols), View (any value, borrowed for the call) and
+ * Value (any value, handed over). A callable without parameters is
+ * called as (f ()), like the builtins that take none, and the one
+ * operand is ignored: (f) on its own evaluates to f. Throwing
+ * tlisp::Error or any std::exception from the callable returns a Lisp
+ * error. pmap and spawn may call it on several threads at once, so it
+ * has to be thread-safe.
+ */
+
+#include "tlisp.h"
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace tlisp {
+
+enum class Type {
+	Error = TLISP_ERROR, Number = TLISP_NUMBER, Symbol = TLISP_SYMBOL,
+	Function = TLISP_FUNCTION, Sexpr = TLISP_SEXPR, Qexpr = TLISP_QEXPR,
+	Sequence = TLISP_SEQUENCE, Future = TLISP_FUTURE,
+	Channel = TLISP_CHANNEL
+};
+
+/* Thrown by a builtin to return a Lisp error */
+class Error : public std::runtime_error
+{
+public:
+	explicit Error(const std::string& msg, int code = TLISP_ERR_USER)
+		: std::runtime_error(msg), code_(code) {}
+	int code() const noexcept { return code_; }
+private:
+	int code_;
+};
+
+/* A borrowed value, valid while its owner is */
+class View
+{
+public:
+	View() noexcept = default;
+	explicit View(const tlisp_value_t* v) noexcept : v_(v) {}
+
+	explicit operator bool() const noexcept { return v_ != nullptr; }
+	const tlisp_value_t* get() const noexcept { return v_; }
+
+	Type type() const noexcept { return static_cast<Type>(tlisp_type(v_)); }
+	bool is_error() const noexcept { return type() == Type::Error; }
+	bool is_num() const noexcept { return type() == Type::Number; }
+	bool is_sym() const noexcept { return type() == Type::Symbol; }
+	bool is_list() const noexcept {
+		return type() == Type::Sexpr || type() == Type::Qexpr;
+	}
+
+	long num() const noexcept { return tlisp_num(v_); }
+	std::string_view sym() const noexcept { return tlisp_sym(v_); }
+	int error_code() const noexcept { return tlisp_error_code(v_); }
+	int size() const noexcept { return tlisp_count(v_); }
+	View operator[](int i) const noexcept { return View(tlisp_cell(v_, i)); }
+
+protected:
+	const tlisp_value_t* v_ = nullptr;
+};
+
+/* An owned value, freed along with the Value */
+class Value : public View
+{
+public:
+	Value() noexcept = default;
+	/* Adopt 'v', made by interpreter 's' */
+	Value(tlisp_state_t* s, tlisp_value_t* v) noexcept : View(v), s_(s) {}
+	~Value() { reset(); }
+
+	Value(const Value&) = delete;
+	Value& operator=(const Value&) = delete;
+	Value(Value&& o) noexcept : View(o.v_), s_(o.s_) { o.v_ = nullptr; }
+	Value& operator=(Value&& o) noexcept {
+		if (this != &o) {
+			reset();
+			v_ = o.v_; s_ = o.s_;
+			o.v_ = nullptr;
+		}
+		return *this;
+	}
+
+	tlisp_value_t* get() const noexcept { return const_cast<tlisp_value_t*>(v_); }
+	tlisp_state_t* state() const noexcept { return s_; }
+	/* Give up ownership, for handing the value back to C */
+	tlisp_value_t* release() noexcept {
+		tlisp_value_t* v = get();
+		v_ = nullptr;
+		return v;
+	}
+	void reset() noexcept {
+		if (v_) { tlisp_free(s_, get()); v_ = nullptr; }
+	}
+	Value clone() const { return Value(s_, tlisp_copy(s_, v_)); }
+
+	std::string error_msg() const { return tlisp_error_msg(s_, get()); }
+	void println() const { tlisp_println(s_, get()); }
+
+	/* Add 'x' to the end of this list, taking it */
+	Value& push(Value x) {
+		tlisp_list_add(s_, get(), x.release());
+		return *this;
+	}
+	/* Take element 'i' out of this list */
+	Value pop(int i) { return Value(s_, tlisp_list_pop(s_, get(), i)); }
+
+private:
+	tlisp_state_t* s_ = nullptr;
+};
+
+namespace detail {
+
+/* How a parameter of a builtin is read from an argument */
+template <class T, class = void>
+struct arg
+{
+	static_assert(sizeof(T) == 0,
+		"builtin parameters must be integers, std::string, tlisp::View or tlisp::Value");
+};
+
+template <class T>
+struct arg<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>>
+{
+	static constexpr int type = TLISP_NUMBER;
+	static T get(Value& v) { return static_cast<T>(v.num()); }
+};
+
+template <>
+struct arg<std::string>
+{
+	static constexpr int type = TLISP_SYMBOL;
+	static std::string get(Value& v) { return std::string(v.sym()); }
+};
+
+template <>
+struct arg<View>
+{
+	static constexpr int type = -1;
+	static View get(Value& v) { return v; }
+};
+
+template <>
+struct arg<Value>
+{
+	static constexpr int type = -1;
+	static Value get(Value& v) { return std::move(v); }
+};
+
+/* How a builtin's result becomes a value */
+template <class R, class = void>
+struct ret
+{
+	static_assert(sizeof(R) == 0,
+		"builtins must return void, an integer, std::string or tlisp::Value");
+};
+
+template <class R>
+struct ret<R, std::enable_if_t<std::is_integral_v<R> && !std::is_same_v<R, bool>>>
+{
+	static tlisp_value_t* make(tlisp_state_t* s, R r) { return tlisp_make_num(s, static_cast<long>(r)); }
+};
+
+template <>
+struct ret<std::string>
+{
+	static tlisp_value_t* make(tlisp_state_t* s, const std::string& r) { return tlisp_make_sym(s, r.c_str()); }
+};
+
+template <>
+struct ret<Value>
+{
+	static tlisp_value_t* make(tlisp_state_t*, Value r) { return r.release(); }
+};
+
+/* Parameter and return types of a callable */
+template <class F>
+struct signature : signature<decltype(&F::operator())> {};
+template <class R, class... A>
+struct signature<R(*)(A...)> { using result = R; using args = std::tuple<A...>; };
+template <class R, class... A>
+struct signature<R(A...)> : signature<R(*)(A...)> {};
+template <class C, class R, class... A>
+struct signature<R(C::*)(A...)> : signature<R(*)(A...)> {};
+template <class C, class R, class... A>
+struct signature<R(C::*)(A...) const> : signature<R(*)(A...)> {};
+template <class R, class... A>
+struct signature<R(*)(A...) noexcept> : signature<R(*)(A...)> {};
+template <class C, class R, class... A>
+struct signature<R(C::*)(A...) noexcept> : signature<R(*)(A...)> {};
+template <class C, class R, class... A>
+struct signature<R(C::*)(A...) const noexcept> : signature<R(*)(A...)> {};
+
+template <class T>
+using bare = std::remove_cv_t<std::remove_reference_t<T>>;
+
+class builtin_base
+{
+public:
+	virtual ~builtin_base() = default;
+};
+
+template <class F, class R, class... A>
+class builtin : public builtin_base
+{
+public:
+	builtin(std::string name, F fn) : name_(std::move(name)), fn_(std::move(fn)) {}
+
+	static tlisp_value_t* call(tlisp_state_t* s, tlisp_value_t* args, void* data) noexcept
+	{
+		return static_cast<builtin*>(data)->run(s, args, std::index_sequence_for<A...>{});
+	}
+
+private:
+	static constexpr int types[] = {arg<bare<A>>::type..., 0};
+
+	template <std::size_t... I>
+	tlisp_value_t* run(tlisp_state_t* s, tlisp_value_t* args, std::index_sequence<I...>) noexcept
+	{
+		constexpr int n = sizeof...(A);
+		try {
+			Value a(s, args);
+			/* With no parameters, the operand of a call like (f ()) is ignored */
+			if (a.size() != n && (n != 0 || a.size() != 1)) {
+				return error(s, TLISP_ERR_ARGS, "Function '" + name_
+					+ "' passed incorrect number of arguments. Got "
+					+ std::to_string(a.size()) + ", Expected "
+					+ (n == 0 ? std::string("0 or 1") : std::to_string(n)) + ".");
+			}
+			for (int i = 0; i < n; i++) {
+				int t = tlisp_type(a[i].get());
+				if (types[i] >= 0 && t != types[i]) {
+					return error(s, TLISP_ERR_TYPE, "Function '" + name_
+						+ "' passed incorrect type for argument " + std::to_string(i)
+						+ ". Got " + tlisp_type_name(t) + ", Expected "
+						+ tlisp_type_name(types[i]) + ".");
+				}
+			}
+			/* Move the arguments out of the list, last first so indices hold */
+			std::array<Value, n> cells;
+			for (int i = n - 1; i >= 0; i--) { cells[i] = a.pop(i); }
+
+			if constexpr (std::is_void_v<R>) {
+				fn_(arg<bare<A>>::get(cells[I])...);
+				return tlisp_make_sexpr(s);
+			} else {
+				return ret<bare<R>>::make(s, fn_(arg<bare<A>>::get(cells[I])...));
+			}
+		} catch (const Error& e) {
+			return error(s, e.code(), e.what());
+		} catch (const std::exception& e) {
+			return error(s, TLISP_ERR_USER, e.what());
+		} catch (...) {
+			return error(s, TLISP_ERR_USER, "Function '" + name_ + "' threw an exception.");
+		}
+	}
+
+	static tlisp_value_t* error(tlisp_state_t* s, int code, const std::string& msg) noexcept
+	{
+		return tlisp_make_error_code(s, code, msg.c_str());
+	}
+
+	std::string name_;
+	F fn_;
+};
+
+template <class F, class R, class Args>
+struct builtin_of;
+template <class F, class R, class... A>
+struct builtin_of<F, R, std::tuple<A...>> { using type = builtin<F, R, A...>; };
+
+} // namespace detail
+
+/* An interpreter, deleted along with the Interpreter */
+class Interpreter
+{
+public:
+	Interpreter() : s_(tlisp_state_new()) {}
+	~Interpreter() { if (s_) { tlisp_state_del(s_); } }
+
+	Interpreter(const Interpreter&) = delete;
+	Interpreter& operator=(const Interpreter&) = delete;
+	Interpreter(Interpreter&& o) noexcept
+		: s_(o.s_), builtins_(std::move(o.builtins_)) { o.s_ = nullptr; }
+	Interpreter& operator=(Interpreter&& o) noexcept {
+		if (this != &o) {
+			if (s_) { tlisp_state_del(s_); }
+			s_ = o.s_; builtins_ = std::move(o.builtins_);
+			o.s_ = nullptr;
+		}
+		return *this;
+	}
+
+	tlisp_state_t* get() const noexcept { return s_; }
+
+	/* Evaluate source text, errors are returned as error values */
+	Value eval(std::string_view src) {
+		return Value(s_, tlisp_eval_buffer(s_, "<string>", src.data(), src.size()));
+	}
+	bool set(int option, long value) { return tlisp_set(s_, option, value) != 0; }
+	bool interrupt() noexcept { return tlisp_interrupt(s_) != 0; }
+
+	Value num(long x) { return Value(s_, tlisp_make_num(s_, x)); }
+	Value sym(const std::string& x) { return Value(s_, tlisp_make_sym(s_, x.c_str())); }
+	/* A Q-Expression of 'xs', taking them */
+	template <class... V>
+	Value list(V&&... xs) {
+		Value l(s_, tlisp_make_list(s_));
+		(l.push(std::forward<V>(xs)), ...);
+		return l;
+	}
+
+	/* Bind 'name' to the callable 'fn' */
+	template <class F>
+	void def(const std::string& name, F fn) {
+		using sig = detail::signature<std::decay_t<F>>;
+		using impl = typename detail::builtin_of<std::decay_t<F>,
+			typename sig::result, typename sig::args>::type;
+		auto b = std::make_unique<impl>(name, std::move(fn));
+		if (!tlisp_register(s_, name.c_str(), &impl::call, b.get())) {
+			throw std::bad_alloc();
+		}
+		builtins_.push_back(std::move(b));
+	}
+
+private:
+	tlisp_state_t* s_;
+	/* Callables registered with def, alive as long as the interpreter */
+	std::vector<std::unique_ptr<detail::builtin_base>> builtins_;
+};
+
+} // namespace tlisp
+
+#endif